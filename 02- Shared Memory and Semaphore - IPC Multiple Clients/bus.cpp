@@ -0,0 +1,214 @@
+// bus.cpp - crash tolerant access to the shared memory segment used by the clients
+//
+// The segment carries a robust process-shared mutex and one pid/heartbeat slot per
+// client. A client that dies while holding the lock, or while the message is
+// addressed to it, is detected by the next client to take the lock and its
+// mailbox is handed to a live client.
+
+#include <errno.h>
+#include <iostream>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+#include "client.h"
+
+using namespace std;
+
+static long long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// kill() with signal 0 performs the permission and existence checks only.
+// EPERM means the process exists but belongs to someone else.
+static bool processAlive(pid_t pid)
+{
+	if (pid <= 0)
+		return false;
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+struct Memory* busAttach(int clientNo, int* shmId)
+{
+	//key_t ftok(const char *pathname, int proj_id);
+	//
+	//The ftok() function uses the identity of the file named by the given pathname
+	//and the least significant 8 bits of proj_id (which must be nonzero) to
+	//generate a key_t type suitable for use with msgget(2), semget(2), or shmget(2).
+	key_t ShmKey = ftok(MEMNAME, 65);
+
+	int ShmID = shmget(ShmKey, sizeof(struct Memory), IPC_CREAT | 0666);
+	if (ShmID < 0) {
+		cout << "client" << clientNo << ": shmget() error" << endl;
+		cout << strerror(errno) << endl;
+		return NULL;
+	}
+
+	struct Memory* mem = (struct Memory*)shmat(ShmID, NULL, 0);
+	if (mem == (void*)-1) {
+		cout << "client" << clientNo << ": shmat() error" << endl;
+		cout << strerror(errno) << endl;
+		return NULL;
+	}
+
+	// A new segment is zero-filled. Exactly one client wins the race to initialize
+	// the mutex, the others wait until it is marked ready.
+	int expected = BUS_UNINIT;
+	if (__atomic_compare_exchange_n(&mem->state, &expected, BUS_INITIALIZING, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		// Shared between processes, and robust so that a dead owner does not
+		// leave the lock taken forever.
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		int rc = pthread_mutex_init(&mem->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		if (rc != 0) {
+			cerr << "Client " << clientNo << " Failed initializing mutex: " << strerror(rc) << endl;
+			__atomic_store_n(&mem->state, BUS_UNINIT, __ATOMIC_RELEASE);
+			shmdt((void*)mem);
+			return NULL;
+		}
+		__atomic_store_n(&mem->state, BUS_READY, __ATOMIC_RELEASE);
+	}
+	else {
+		long long deadline = nowMs() + HEARTBEAT_TIMEOUT_MS;
+		while (__atomic_load_n(&mem->state, __ATOMIC_ACQUIRE) != BUS_READY) {
+			if (nowMs() > deadline) {
+				cerr << "Client " << clientNo << " Timed out waiting for the bus to be initialized" << endl;
+				shmdt((void*)mem);
+				return NULL;
+			}
+			usleep(1000);
+		}
+	}
+
+	// Claim our slot. A slot left behind by a crashed client with the same
+	// number is simply taken over.
+	if (busLock(mem, clientNo) != 0) {
+		shmdt((void*)mem);
+		return NULL;
+	}
+	struct ClientSlot* slot = &mem->clients[clientNo];
+	if (slot->pid != 0 && slot->pid != getpid() && processAlive(slot->pid)) {
+		cerr << "Client " << clientNo << " is already running as pid " << slot->pid << endl;
+		busUnlock(mem);
+		shmdt((void*)mem);
+		return NULL;
+	}
+	slot->pid = getpid();
+	__atomic_store_n(&slot->heartbeat_ms, nowMs(), __ATOMIC_RELEASE);
+	busUnlock(mem);
+
+	*shmId = ShmID;
+	return mem;
+}
+
+void busDetach(struct Memory* mem, int shmId, int clientNo)
+{
+	bool last = true;
+
+	if (busLock(mem, clientNo) == 0) {
+		mem->clients[clientNo].pid = 0;
+		// Do not leave with the message addressed to us, pass it on.
+		if (mem->destClientNo == clientNo)
+			mem->destClientNo = busRoute(mem, 0, clientNo);
+		for (int i = 1; i <= NUM_CLIENTS; ++i) {
+			if (processAlive(mem->clients[i].pid))
+				last = false;
+		}
+		busUnlock(mem);
+	}
+
+	shmdt((void*)mem);
+	// Only the last client out removes the segment, so a client that is still
+	// running never has the memory pulled from under it.
+	if (last)
+		shmctl(shmId, IPC_RMID, NULL);
+}
+
+int busLock(struct Memory* mem, int clientNo)
+{
+	int rc = pthread_mutex_lock(&mem->lock);
+	if (rc == EOWNERDEAD) {
+		// The previous owner died inside the critical section. We now own the
+		// lock; repair the shared state before marking it consistent.
+		cerr << "Client " << clientNo << " recovered the bus lock from a dead client" << endl;
+		busReapDead(mem, clientNo);
+		rc = pthread_mutex_consistent(&mem->lock);
+	}
+	if (rc != 0)
+		cerr << "Client " << clientNo << " Failed acquiring the bus lock: " << strerror(rc) << endl;
+	return rc;
+}
+
+void busUnlock(struct Memory* mem)
+{
+	pthread_mutex_unlock(&mem->lock);
+}
+
+void busHeartbeat(struct Memory* mem, int clientNo)
+{
+	__atomic_store_n(&mem->clients[clientNo].heartbeat_ms, nowMs(), __ATOMIC_RELEASE);
+}
+
+bool busPeerAlive(struct Memory* mem, int clientNo)
+{
+	if (clientNo < 1 || clientNo > NUM_CLIENTS)
+		return false;
+	struct ClientSlot* slot = &mem->clients[clientNo];
+	if (!processAlive(slot->pid))
+		return false;
+	long long beat = __atomic_load_n(&slot->heartbeat_ms, __ATOMIC_ACQUIRE);
+	return nowMs() - beat < HEARTBEAT_TIMEOUT_MS;
+}
+
+// Must be called with the bus lock held. Frees the slots of clients whose process
+// is gone and, if the message is addressed to a dead or hung client, reclaims it
+// for the caller. Returns the number of slots freed.
+int busReapDead(struct Memory* mem, int clientNo)
+{
+	int reaped = 0;
+
+	for (int i = 1; i <= NUM_CLIENTS; ++i) {
+		if (i == clientNo || mem->clients[i].pid == 0)
+			continue;
+		if (!processAlive(mem->clients[i].pid)) {
+			cerr << "Client " << clientNo << " detected that client " << i
+				<< " (pid " << mem->clients[i].pid << ") died" << endl;
+			mem->clients[i].pid = 0;
+			++reaped;
+		}
+	}
+
+	unsigned short dest = mem->destClientNo;
+	if (dest != 0 && dest != clientNo && !busPeerAlive(mem, dest)) {
+		cerr << "Client " << clientNo << " reclaimed the mailbox of client " << dest << endl;
+		mem->srcClientNo = dest;
+		mem->destClientNo = clientNo;
+		memset(mem->message, 0, BUF_LEN);
+		sprintf(mem->message, "Mailbox of client %d reclaimed by client %d\n", dest, clientNo);
+	}
+
+	return reaped;
+}
+
+// Returns preferred if that client is alive, otherwise the first other live
+// client. Falls back to the caller when nobody else is on the bus.
+unsigned short busRoute(struct Memory* mem, unsigned short preferred, int clientNo)
+{
+	if (preferred != clientNo && busPeerAlive(mem, preferred))
+		return preferred;
+	for (int i = 1; i <= NUM_CLIENTS; ++i) {
+		if (i != clientNo && busPeerAlive(mem, i))
+			return i;
+	}
+	return clientNo;
+}
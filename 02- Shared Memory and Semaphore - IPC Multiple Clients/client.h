@@ -1,27 +1,54 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-// Define the permissions for the semaphore.
-// SEM_PERMS allows read and write access for the user (S_IRUSR | S_IWUSR),
-// and read and write access for the group (S_IRGRP | S_IWGRP).
-// This combination ensures that the semaphore can be accessed by the user and the group for synchronization purposes.
-#define SEM_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
-
-// Semaphore name used for synchronization
-// This name is used when creating or accessing the semaphore to synchronize access
-// between different client processes.
-const char* semName = "semName";
+#include <pthread.h>
+#include <sys/types.h>
 
 const char MEMNAME[]="MemDispatch";
 const int BUF_LEN=1024;
 const int NUM_MESSAGES=30;
+const int NUM_CLIENTS=3;
+
+// A client whose heartbeat is older than this is treated as hung and routed around,
+// even if its pid still exists.
+const long long HEARTBEAT_TIMEOUT_MS=3000;
+
+// Life cycle of the shared segment. A freshly created segment is zero-filled,
+// so the first client to move BUS_UNINIT -> BUS_INITIALIZING sets up the lock.
+enum BusState {
+    BUS_UNINIT       = 0,
+    BUS_INITIALIZING = 1,
+    BUS_READY        = 2
+};
+
+// One slot per client number. pid is 0 while the slot is free.
+struct ClientSlot {
+    pid_t     pid;
+    long long heartbeat_ms;   // CLOCK_MONOTONIC time of the last heartbeat
+};
 
 struct Memory {
+    int             state;    // BusState, accessed atomically
+    // Robust, process-shared mutex. Replaces the named semaphore: if the owner
+    // dies inside the critical section the next locker gets EOWNERDEAD instead
+    // of blocking forever.
+    pthread_mutex_t lock;
     int            packet_no;
     unsigned short srcClientNo;
     unsigned short destClientNo;
     char           message[BUF_LEN];
+    ClientSlot     clients[NUM_CLIENTS + 1];   // indexed by client number, slot 0 unused
 };
 
+// bus.cpp - shared memory bus helpers used by every client
+struct Memory* busAttach(int clientNo, int* shmId);
+void busDetach(struct Memory* mem, int shmId, int clientNo);
+int busLock(struct Memory* mem, int clientNo);
+void busUnlock(struct Memory* mem);
+void busHeartbeat(struct Memory* mem, int clientNo);
+bool busPeerAlive(struct Memory* mem, int clientNo);
+int busReapDead(struct Memory* mem, int clientNo);
+unsigned short busRoute(struct Memory* mem, unsigned short preferred, int clientNo);
+
 void *recv_func(void *arg);
 #endif//CLIENT_H
@@ -10,7 +10,6 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <semaphore.h>
 #include "client.h"
 
 using namespace std;
@@ -27,7 +26,6 @@ static void sigHandler(int sig)
 }
 
 int main(void) {
-	key_t          ShmKey;
 	int            ShmID;
 	struct Memory* ShmPTR;
 
@@ -38,107 +36,61 @@ int main(void) {
 	action.sa_flags = 0;
 	sigaction(SIGINT, &action, NULL);
 
-	//key_t ftok(const char *pathname, int proj_id);
-	//
-	//The ftok() function uses the identity of the file named by the given pathname
-	//and the least significant 8 bits of proj_id (which must be nonzero) to
-	//generate a key_t type suitable for use with msgget(2), semget(2), or shmget(2).
-	ShmKey = ftok(MEMNAME, 65);
-
-	//int shmget(key_t key, size_t size, int shmflg);
-	//
-	//shmget() returns the identifier of the shared memory segment associated with
-	//the value of the argument key.
-	//struct Memory {
-	//    int           packet_no;
-	//    unsigned char sourceIP[4];
-	//    unsigned char destIP[4];
-	//    char          message[BUF_LEN];
-	//};
-
-	ShmID = shmget(ShmKey, sizeof(struct Memory), IPC_CREAT | 0666);
-	if (ShmID < 0) {
-		cout << "client3: shmget() error" << endl;
-		cout << strerror(errno) << endl;
+	// Create or attach the shared memory segment and claim our client slot.
+	// The segment carries a robust process-shared mutex in place of a named
+	// semaphore, so a client dying inside the critical section cannot stall
+	// the others (see bus.cpp).
+	ShmPTR = busAttach(CLIENT_NO, &ShmID);
+	if (ShmPTR == NULL) {
+		cerr << "Client " << CLIENT_NO << " Failed attaching to the bus" << endl;
 		return -1;
 	}
 
-	//void *shmat(int shmid, const void *shmaddr, int shmflg);
-	//
-	//shmat() attaches the shared memory segment identified by shmid to the
-	//address space of the calling process. The attaching address is specified
-	//by shmaddr. If shmaddr is NULL, the system chooses a suitable (unused)
-	//page-aligned address to attach the segment.
-	ShmPTR = (struct Memory*)shmat(ShmID, NULL, 0);
-	if (ShmPTR == (void*)-1) {
-		cout << "client3: shmat() error" << endl;
-		cout << strerror(errno) << endl;
-		return -1;
-	}
-
-	// initialize named semaphore, can be used between processes for synchronization.
-	// This ensures that multiple processes can safely access shared resources without race conditions.
-	sem_t* sem_id = sem_open(semName, O_CREAT, SEM_PERMS, 0);
-	if (sem_id == SEM_FAILED) {
-		cerr << "Client " << CLIENT_NO  << " Failed initializing semaphore: " << strerror(errno) << endl;
-		exit(1);
+	//Client 3 starts everything
+	if (busLock(ShmPTR, CLIENT_NO) == 0) {
+		ShmPTR->srcClientNo = CLIENT_NO;
+		ShmPTR->destClientNo = busRoute(ShmPTR, 1, CLIENT_NO);
+		memset(ShmPTR->message, 0, BUF_LEN);
+		sprintf(ShmPTR->message, "This is message 0 from client %d\n", CLIENT_NO);
+
+		// Release the lock, allowing other processes to proceed.
+		busUnlock(ShmPTR);
 	}
 
-	//Client 3 starts everything
-	ShmPTR->srcClientNo = CLIENT_NO;
-	ShmPTR->destClientNo = 1;
-	memset(ShmPTR->message, 0, BUF_LEN);
-	sprintf(ShmPTR->message, "This is message 0 from client %d\n", CLIENT_NO);
+	for (int i = 0; i < NUM_MESSAGES && is_running; ++i) {
 
-	// Release the semaphore, allowing other processes to proceed.
-	if (sem_post(sem_id) < 0)
-		cerr << "Client " << CLIENT_NO << " Failed  releasing the semaphore: " << strerror(errno) << endl;
+		// Let the other clients know we are still alive.
+		busHeartbeat(ShmPTR, CLIENT_NO);
 
-	for (int i = 0; i < NUM_MESSAGES && is_running; ++i) {
-		if (ShmPTR->destClientNo == CLIENT_NO) {
+		// Acquire the lock before looking at the shared memory.
+		// If the previous owner died while holding it, busLock() repairs the lock.
+		if (busLock(ShmPTR, CLIENT_NO) != 0)
+			break;
 
-			// Wait for the semaphore to be available before proceeding (synchronization step).
-			// This ensures that only one process can access the shared memory at a time.
-			if (sem_wait(sem_id) < 0)
-				cerr << "Client " << CLIENT_NO << " Failed waiting for the semaphore to acquire: " << strerror(errno) << endl;
+		// Take over a message that is addressed to a crashed or hung client.
+		busReapDead(ShmPTR, CLIENT_NO);
 
+		if (ShmPTR->destClientNo == CLIENT_NO) {
 			cout << "Client " << CLIENT_NO << " has received a message from client " << ShmPTR->srcClientNo << ":" << endl;
 			cout << ShmPTR->message << endl;
 			//Send a message to client 1 or 2
 			ShmPTR->srcClientNo = CLIENT_NO;
-			ShmPTR->destClientNo = 1 + i % 2;//send a message to client 1 or 2
+			ShmPTR->destClientNo = busRoute(ShmPTR, 1 + i % 2, CLIENT_NO);//send a message to client 1 or 2
 			memset(ShmPTR->message, 0, BUF_LEN);
 			sprintf(ShmPTR->message, "This is message %d from client %d\n", i + 1, CLIENT_NO);
-
-			// Release the semaphore so the next process can access the shared memory.
-			if (sem_post(sem_id) < 0)
-				cerr << "Client " << CLIENT_NO << " Failed  releasing the semaphore: " << strerror(errno) << endl;
 		}
+
+		// Release the lock so the next process can access the shared memory.
+		busUnlock(ShmPTR);
+
 		// Sleep for 1 second to simulate a delay between message sends/receives.
 		// This allows other processes to run and ensures proper synchronization between them.
 		sleep(1);
 	}
 
-
-	// Close the reference to the semaphore once done.
-	// This ensures proper cleanup and avoids resource leaks.
-	if (sem_close(sem_id) != 0) {
-		cerr << "Client " << CLIENT_NO << " Failed closing reference to semaphore: " << strerror(errno) << endl;
-		exit(1);
-	}
-
-	// Remove the named semaphore from the system.
-	// This ensures that the semaphore is cleaned up after use.
-	if (sem_unlink(semName) < 0) {
-		// If the semaphore removal fails, check if the error is not due to the semaphore already being removed.
-		if (errno != ENOENT) {
-			cerr << "Client " << CLIENT_NO << " Failed removing semaphore: " << strerror(errno) << endl;
-		}
-	}
-
-
-	shmdt((void*)ShmPTR);
-	shmctl(ShmID, IPC_RMID, NULL);
+	// Free our slot, hand the message on if it is ours, and remove the segment
+	// if we are the last client attached.
+	busDetach(ShmPTR, ShmID, CLIENT_NO);
 
 	cout << "client3: DONE" << endl;
 
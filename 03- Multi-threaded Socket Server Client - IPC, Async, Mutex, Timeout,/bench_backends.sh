@@ -0,0 +1,62 @@
+#!/bin/bash
+# bench_backends.sh - run the same flood against the epoll and io_uring backends
+#
+# For each backend: start the server, send the load with the flood client, stop
+# the server with Ctrl-C, then report the CPU time its reactor threads used and
+# the server's own counters (messages, I/O system calls per message).
+usage() {
+	echo "usage: bench_backends.sh [-r reactors] [-c connections] [-n messages] [-s size] <port number>"
+}
+
+REACTORS=1
+CONNECTIONS=8
+MESSAGES=200000
+SIZE=64
+while getopts "r:c:n:s:" opt; do
+	case $opt in
+	r) REACTORS=$OPTARG ;;
+	c) CONNECTIONS=$OPTARG ;;
+	n) MESSAGES=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	*) usage; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+	usage
+	exit 1
+fi
+PORT=$1
+TICKS=$(getconf CLK_TCK)
+
+# Sum utime + stime (fields 14 and 15) of the server's reactor threads
+reactorCpu() {
+	local total=0
+	for task in /proc/$1/task/*; do
+		if grep -q '^reactor' $task/comm 2>/dev/null; then
+			local stat=($(sed 's/^.*) //' $task/stat))
+			total=$((total + ${stat[11]} + ${stat[12]}))
+		fi
+	done
+	echo $total
+}
+
+for backend in epoll uring; do
+	out=$(mktemp)
+	./server -r $REACTORS -b $backend $PORT > $out 2>&1 &
+	server=$!
+	sleep 0.5
+
+	./client1 -c $CONNECTIONS -n $MESSAGES -s $SIZE $PORT
+	# Let the reactors finish reading what is still in the socket buffers
+	sleep 1
+	ticks=$(reactorCpu $server)
+	kill -INT $server
+	wait $server
+
+	total=$((CONNECTIONS * MESSAGES))
+	awk -v b=$backend -v t=$ticks -v hz=$TICKS -v n=$total \
+		'BEGIN { printf "== %s: reactor CPU %.2f s, %.0f ns per message\n", b, t / hz, t * 1e9 / hz / n }'
+	sed -n '/^Total:/,$p' $out
+	rm -f $out
+done
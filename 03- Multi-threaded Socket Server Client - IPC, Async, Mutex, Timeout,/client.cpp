@@ -13,6 +13,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "loadgen.h"
+#include "protocol.h"
 
 using namespace std;
 
@@ -21,34 +23,106 @@ const int BUF_LEN=4096;
 
 void *recv_func(void *arg);
 
-int main(int argc, char *argv[])
+void usage()
+{
+    cout<<"usage: client [-c connections] [-n messages] [-d seconds] [-r rate] [-s size] [-e] <port number>"<<endl;
+    cout<<"  without options, send one message a second until the server says Quit"<<endl;
+    cout<<"  any option below selects load generator mode:"<<endl;
+    cout<<"  -c connections  number of connections (default 1)"<<endl;
+    cout<<"  -n messages     stop after this many messages per connection"<<endl;
+    cout<<"  -d seconds      stop after this long (default 10 unless -n is given)"<<endl;
+    cout<<"  -r rate         messages per second over all connections (default: as fast as possible)"<<endl;
+    cout<<"  -s size         payload size in bytes (default 64)"<<endl;
+    cout<<"  -e              send requests, which the server answers (echoed with server -e):"<<endl;
+    cout<<"                  report round-trip latency percentiles"<<endl;
+}
+
+int connectTo(int port)
 {
-    //Set up socket communications
     struct sockaddr_in addr;
-    char buf[BUF_LEN];
-    int len, ret;
-    int fd,rc;
+    int fd;
 
-    if(argc<2) {
-        cout<<"usage: client <port number>"<<endl;
-	return -1;
-    }
-    cout<<"client("<<getpid()<<"): running..."<<endl;
     memset(&addr, 0, sizeof(addr));
     //Create the socket
     if ( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         cout << "client("<<getpid()<<"): "<<strerror(errno)<<endl;
-        exit(-1);
+        return -1;
     }
 
     addr.sin_family = AF_INET;
     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-    addr.sin_port = htons(atoi(argv[1]));
+    addr.sin_port = htons(port);
 
     //Connect to the local socket
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         cout << "client("<<getpid()<<"): " << strerror(errno) << endl;
         close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    //Set up socket communications
+    char buf[BUF_LEN];
+    int len, ret;
+    int fd,opt;
+    bool load=false;
+    LoadOptions options;
+    options.connections = 1;
+    options.messages = 0;
+    options.duration = 0;
+    options.rate = 0;
+    options.size = 64;
+    options.requests = false;
+
+    while((opt = getopt(argc, argv, "c:n:d:r:s:e")) != -1) {
+        load = true;
+        switch(opt) {
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'n':
+            options.messages = atol(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 's':
+            options.size = atoi(optarg);
+            break;
+        case 'e':
+            options.requests = true;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if(optind!=argc-1 || options.connections<1 || options.size<0 || options.size>(int)MAX_FRAME_PAYLOAD) {
+        usage();
+	return -1;
+    }
+    //Requests carry their send time in the first 8 body bytes
+    if(options.requests && options.size<8) {
+        cout<<"client: -e needs a payload of at least 8 bytes"<<endl;
+        return -1;
+    }
+    int port = atoi(argv[optind]);
+    if(load) {
+        if(options.messages==0 && options.duration==0) {
+            options.duration = 10;
+        }
+        return runLoad(port, &options) < 0 ? -1 : 0;
+    }
+
+    cout<<"client("<<getpid()<<"): running..."<<endl;
+    fd = connectTo(port);
+    if(fd<0) {
         exit(-1);
     }
 
@@ -69,7 +143,8 @@ Bereft of life, it rests in peace! If you hadn't nailed it to the perch, it\n\
 would be pushing up the daisies!\n\
 It's rung down the curtain and joined the choir invisible. This is an ex-parrot!\n", getpid());
         cout<<"client("<<getpid()<<"): write "<<len<<" bytes"<<endl;
-        ret = write(fd, buf, len);
+        //Each message goes out as one length-prefixed frame
+        ret = writeFrame(fd, buf, len);
         if(ret==-1) {
             cout<<"client("<<getpid()<<"): Write Error"<<endl;
             cout<<strerror(errno)<<endl;
@@ -84,16 +159,35 @@ It's rung down the curtain and joined the choir invisible. This is an ex-parrot!
 void *recv_func(void *arg)
 {
     int fd = *(int *)arg;
-    char buf[BUF_LEN];
+    FrameParser parser;
+    parserInit(&parser);
     while(is_running)
     {
-        int len = read(fd,buf,BUF_LEN);
+        uint32_t space;
+        char *buf = parserSpace(&parser, &space);
+        if(buf==NULL) break;
+        int len = read(fd,buf,space);
         cout<<"client("<<getpid()<<"): read "<<len<<" bytes"<<endl;
-        if(len<0) sleep(1);
-        else if(strcmp(buf, "Quit")==0) {
-            cout<<"client("<<getpid()<<"): received request to quit"<<endl;
+        if(len<0) {
+            sleep(1);
+            continue;
+        }
+        if(len==0) {
+            cout<<"client("<<getpid()<<"): server closed the connection"<<endl;
             is_running = false;
+            break;
+        }
+        parserCommit(&parser, len);
+        //A read may end in the middle of a frame, the rest arrives with the next read
+        const char *payload;
+        uint32_t payload_len;
+        while(parserNext(&parser, &payload, &payload_len)>0) {
+            if(payload_len==4 && memcmp(payload, "Quit", 4)==0) {
+                cout<<"client("<<getpid()<<"): received request to quit"<<endl;
+                is_running = false;
+            }
         }
     }
+    parserFree(&parser);
     pthread_exit(NULL);
 }
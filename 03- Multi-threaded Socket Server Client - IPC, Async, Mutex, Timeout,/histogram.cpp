@@ -0,0 +1,82 @@
+// histogram.cpp - log-linear histogram
+
+#include <string.h>       // For memset()
+#include "histogram.h"
+
+static int bucketIndex(uint64_t value)
+{
+	if (value < HIST_SUB_COUNT) {
+		return (int)value;
+	}
+	// Position of the highest set bit picks the power of two, the next
+	// HIST_SUB_BITS bits pick the bucket inside it
+	int exponent = 63 - __builtin_clzll(value);
+	int shift = exponent - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+// Largest value that falls into bucket index
+static uint64_t bucketLimit(int index)
+{
+	if (index < HIST_SUB_COUNT) {
+		return index;
+	}
+	int shift = index / HIST_SUB_COUNT - 1;
+	uint64_t base = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+	return base + ((uint64_t)1 << shift) - 1;
+}
+
+void histInit(Histogram* hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+void histRecord(Histogram* hist, uint64_t value)
+{
+	hist->buckets[bucketIndex(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value < hist->min) {
+		hist->min = value;
+	}
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+void histMerge(Histogram* into, const Histogram* from)
+{
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	into->sum += from->sum;
+	if (from->min < into->min) {
+		into->min = from->min;
+	}
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+uint64_t histPercentile(const Histogram* hist, double fraction)
+{
+	if (hist->count == 0) {
+		return 0;
+	}
+	uint64_t target = (uint64_t)(fraction * hist->count + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			// Never report more than the largest sample
+			uint64_t limit = bucketLimit(i);
+			return limit < hist->max ? limit : hist->max;
+		}
+	}
+	return hist->max;
+}
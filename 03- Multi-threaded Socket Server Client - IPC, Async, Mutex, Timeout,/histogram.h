@@ -0,0 +1,32 @@
+// histogram.h - log-linear histogram for latencies and sizes
+//
+// Values below 2^HIST_SUB_BITS get a bucket each; above that every power of
+// two is split into 2^HIST_SUB_BITS equal buckets, so any recorded value is
+// reported within about 3% of its true size. Recording is a few instructions
+// and never allocates, and histograms of several threads can be merged.
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct Histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void histInit(Histogram* hist);
+void histRecord(Histogram* hist, uint64_t value);
+void histMerge(Histogram* into, const Histogram* from);
+
+// Smallest value v such that at least fraction (0..1) of the samples are <= v,
+// rounded up to the end of its bucket. 0 for an empty histogram.
+uint64_t histPercentile(const Histogram* hist, double fraction);
+
+#endif//HISTOGRAM_H
@@ -0,0 +1,327 @@
+// loadgen.cpp - load generator mode of the client
+//
+// Every connection has a sender thread and, with requests, a receiver thread.
+// The sender follows a fixed schedule (open loop): message i of a connection
+// is due at start + i * interval, whether or not earlier responses have
+// returned. Latency is measured from the due time, so a stalled server shows
+// up as latency instead of as a sender that politely waited.
+//
+// Request i carries id i and its due time in the first 8 body bytes. An echoed
+// response brings the due time back; a bare acknowledgement only has the id,
+// from which the due time follows when there is a rate.
+
+#include <iostream>       // For cout
+#include <atomic>         // For std::atomic
+#include <pthread.h>      // For pthread_create(), pthread_join()
+#include <sys/socket.h>   // For send(), shutdown()
+#include <time.h>         // For clock_gettime(), clock_nanosleep()
+#include <unistd.h>       // For read(), write(), close()
+#include <cstring>        // For memcpy(), memset(), strerror()
+#include <errno.h>        // For errno
+#include "histogram.h"
+#include "loadgen.h"
+#include "protocol.h"
+
+using namespace std;
+
+// client.cpp
+int connectTo(int port);
+
+struct LoadConnection {
+	const LoadOptions* options;
+	int                fd;
+	pthread_t          sender;
+	pthread_t          receiver;
+	uint64_t           start_ns;      // Due time of the first message
+	uint64_t           interval_ns;   // Between two messages, 0 for as fast as possible
+	uint64_t           end_ns;        // Stop sending here, 0 for no limit
+	atomic<long>       sent;
+	atomic<long>       received;
+	long               unexpected;    // Responses out of order or malformed, receiver only
+	uint64_t           last_echo_ns;  // Receiver thread only, read after join
+	Histogram          latency;       // Receiver thread only
+};
+
+static uint64_t monotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static int writeAll(int fd, const char* data, size_t len)
+{
+	while (len > 0) {
+		// A server that closed the connection is reported, not fatal (SIGPIPE)
+		ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void* senderThread(void* arg)
+{
+	LoadConnection* conn = (LoadConnection*)arg;
+	const LoadOptions* options = conn->options;
+
+	// Build LOAD_BATCH frames once; only ids and timestamps change between batches
+	uint32_t id_len = options->requests ? REQUEST_ID_SIZE : 0;
+	uint32_t body = FRAME_HEADER_SIZE + id_len;
+	uint32_t frame_len = body + options->size;
+	char* batch = new char[(size_t)frame_len * LOAD_BATCH];
+	for (int i = 0; i < LOAD_BATCH; ++i) {
+		char* frame = batch + (size_t)i * frame_len;
+		frameHeader(frame, id_len + options->size, options->requests ? FRAME_REQUEST : 0);
+		memset(frame + body, 'a' + i % 26, options->size);
+	}
+
+	// All connections start together, once every thread is up
+	sleepUntil(conn->start_ns);
+
+	long sent = 0;
+	while (true) {
+		uint64_t now = monotonicNs();
+		if (conn->end_ns != 0 && now >= conn->end_ns) {
+			break;
+		}
+		long count = LOAD_BATCH;
+		if (options->messages > 0 && options->messages - sent < count) {
+			count = options->messages - sent;
+		}
+		if (count == 0) {
+			break;
+		}
+		if (conn->interval_ns > 0) {
+			// Everything that is due by now goes out in one write
+			uint64_t next_due = conn->start_ns + sent * conn->interval_ns;
+			if (now < next_due) {
+				sleepUntil(next_due);
+				continue;
+			}
+			long due = (long)((now - conn->start_ns) / conn->interval_ns) + 1 - sent;
+			if (due < count) {
+				count = due;
+			}
+		}
+
+		for (long i = 0; i < count; ++i) {
+			char* frame = batch + (size_t)i * frame_len;
+			uint64_t id = sent + i;
+			uint64_t stamp = conn->interval_ns > 0 ? conn->start_ns + id * conn->interval_ns : now;
+			if (id_len > 0) {
+				memcpy(frame + FRAME_HEADER_SIZE, &id, sizeof(id));
+			}
+			if (options->size >= (int)sizeof(stamp)) {
+				memcpy(frame + body, &stamp, sizeof(stamp));
+			}
+		}
+		if (writeAll(conn->fd, batch, (size_t)count * frame_len) < 0) {
+			cout << "client(" << getpid() << "): Write Error" << endl;
+			cout << strerror(errno) << endl;
+			break;
+		}
+		sent += count;
+		conn->sent.store(sent);
+	}
+	delete[] batch;
+	pthread_exit(NULL);
+}
+
+static void* receiverThread(void* arg)
+{
+	LoadConnection* conn = (LoadConnection*)arg;
+	FrameParser parser;
+	parserInit(&parser);
+
+	while (true) {
+		uint32_t space;
+		char* buf = parserSpace(&parser, &space);
+		if (buf == NULL) {
+			break;
+		}
+		int len = read(conn->fd, buf, space);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			// Closed by the server, or shut down by runLoad() once the echoes are in
+			break;
+		}
+		parserCommit(&parser, len);
+
+		uint64_t now = monotonicNs();
+		conn->last_echo_ns = now;
+		const char* payload;
+		uint32_t payload_len;
+		uint32_t flags;
+		while (parserNext(&parser, &payload, &payload_len, &flags) > 0) {
+			if (flags == 0 && payload_len == 4 && memcmp(payload, "Quit", 4) == 0) {
+				cout << "client(" << getpid() << "): received request to quit" << endl;
+				continue;
+			}
+			if (flags == FRAME_PING) {
+				continue;
+			}
+			// Responses come back in request order, so the id must be the next one
+			long received = conn->received.load(memory_order_relaxed);
+			uint64_t id;
+			if (flags != FRAME_RESPONSE || payload_len < REQUEST_ID_SIZE) {
+				conn->unexpected++;
+				continue;
+			}
+			memcpy(&id, payload, sizeof(id));
+			if (id != (uint64_t)received) {
+				conn->unexpected++;
+			}
+
+			uint64_t stamp;
+			if (payload_len >= REQUEST_ID_SIZE + sizeof(stamp)) {
+				memcpy(&stamp, payload + REQUEST_ID_SIZE, sizeof(stamp));
+				histRecord(&conn->latency, now > stamp ? now - stamp : 0);
+			}
+			else if (conn->interval_ns > 0) {
+				stamp = conn->start_ns + id * conn->interval_ns;
+				histRecord(&conn->latency, now > stamp ? now - stamp : 0);
+			}
+			conn->received.store(received + 1, memory_order_relaxed);
+		}
+	}
+	parserFree(&parser);
+	pthread_exit(NULL);
+}
+
+static void printLatency(const Histogram* hist)
+{
+	cout << "latency (us): min " << hist->min / 1000.0
+		<< "  avg " << (double)hist->sum / hist->count / 1000.0
+		<< "  p50 " << histPercentile(hist, 0.50) / 1000.0
+		<< "  p90 " << histPercentile(hist, 0.90) / 1000.0
+		<< "  p99 " << histPercentile(hist, 0.99) / 1000.0
+		<< "  p99.9 " << histPercentile(hist, 0.999) / 1000.0
+		<< "  max " << hist->max / 1000.0 << endl;
+}
+
+int runLoad(int port, const LoadOptions* options)
+{
+	int count = options->connections;
+	LoadConnection* conns = new LoadConnection[count];
+
+	for (int i = 0; i < count; ++i) {
+		conns[i].options = options;
+		conns[i].fd = connectTo(port);
+		if (conns[i].fd < 0) {
+			for (int j = 0; j < i; ++j) {
+				close(conns[j].fd);
+			}
+			delete[] conns;
+			return -1;
+		}
+	}
+
+	// Connections share the rate; their schedules are staggered so the
+	// messages do not all fall due at the same instant
+	uint64_t interval = options->rate > 0 ? (uint64_t)(1e9 * count / options->rate) : 0;
+	uint64_t start = monotonicNs() + 10000000ull;
+	for (int i = 0; i < count; ++i) {
+		LoadConnection* conn = &conns[i];
+		conn->interval_ns = interval;
+		conn->start_ns = start + (interval > 0 ? interval * i / count : 0);
+		conn->end_ns = options->duration > 0 ? start + (uint64_t)(options->duration * 1e9) : 0;
+		conn->sent = 0;
+		conn->received = 0;
+		conn->unexpected = 0;
+		conn->last_echo_ns = 0;
+		histInit(&conn->latency);
+		if (options->requests && pthread_create(&conn->receiver, NULL, receiverThread, conn) != 0) {
+			cout << "Cannot create receive thread" << endl;
+			exit(-1);
+		}
+		if (pthread_create(&conn->sender, NULL, senderThread, conn) != 0) {
+			cout << "Cannot create send thread" << endl;
+			exit(-1);
+		}
+	}
+
+	long sent = 0;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(conns[i].sender, NULL);
+		sent += conns[i].sent.load();
+	}
+	double seconds = (monotonicNs() - start) / 1e9;
+
+	long received = 0;
+	long unexpected = 0;
+	uint64_t last_echo = start;
+	Histogram latency;
+	histInit(&latency);
+	if (options->requests) {
+		// Give the responses still in flight a moment, then unblock the receivers
+		uint64_t deadline = monotonicNs() + LOAD_DRAIN_SECONDS * 1000000000ull;
+		for (int i = 0; i < count; ++i) {
+			while (conns[i].received.load() < conns[i].sent.load() && monotonicNs() < deadline) {
+				usleep(1000);
+			}
+			shutdown(conns[i].fd, SHUT_RDWR);
+		}
+		for (int i = 0; i < count; ++i) {
+			pthread_join(conns[i].receiver, NULL);
+			received += conns[i].received.load();
+			unexpected += conns[i].unexpected;
+			histMerge(&latency, &conns[i].latency);
+			if (conns[i].last_echo_ns > last_echo) {
+				last_echo = conns[i].last_echo_ns;
+			}
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		close(conns[i].fd);
+	}
+
+	// Without a rate the senders only measure how fast the socket buffers fill;
+	// with requests the rate at which responses came back is the server's throughput
+	cout << "client(" << getpid() << "): sent " << sent << " messages of " << options->size << " bytes on "
+		<< count << " connection(s) in " << seconds << " s: " << (long)(sent / seconds) << " messages/s, "
+		<< sent * (FRAME_HEADER_SIZE + options->size) / seconds / 1e6 << " MB/s" << endl;
+	if (options->rate > 0 && sent / seconds < options->rate * 0.95) {
+		cout << "client(" << getpid() << "): could not keep up with " << options->rate << " messages/s" << endl;
+	}
+	if (options->requests) {
+		double echo_seconds = (last_echo - start) / 1e9;
+		cout << "client(" << getpid() << "): received " << received << " responses";
+		if (echo_seconds > 0) {
+			cout << " in " << echo_seconds << " s: " << (long)(received / echo_seconds) << " messages/s";
+		}
+		if (received < sent) {
+			cout << ", " << sent - received << " missing";
+		}
+		if (unexpected > 0) {
+			cout << ", " << unexpected << " out of order or malformed";
+		}
+		cout << endl;
+		if (latency.count > 0) {
+			printLatency(&latency);
+		}
+		else if (received > 0) {
+			cout << "client(" << getpid() << "): acknowledgements without a rate (-r) carry no send time, "
+				"latency not measured" << endl;
+		}
+	}
+	delete[] conns;
+	return 0;
+}
@@ -0,0 +1,21 @@
+// loadgen.h - load generator mode of the client
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#define LOAD_BATCH 64             // Most frames sent by one write()
+#define LOAD_DRAIN_SECONDS 5      // Wait this long for outstanding responses at the end
+
+struct LoadOptions {
+	int    connections;   // Connections, each with its own sender thread
+	long   messages;      // Per connection, 0 for no limit
+	double duration;      // Seconds, 0 for no limit
+	double rate;          // Messages per second over all connections, 0 for as fast as possible
+	int    size;          // Payload bytes
+	bool   requests;      // Send request frames and measure the round trip of their responses
+};
+
+// Opens the connections, runs the load and prints throughput and, with
+// requests, the latency percentiles. Returns 0 on success, -1 when a connection failed.
+int runLoad(int port, const LoadOptions* options);
+
+#endif//LOADGEN_H
@@ -0,0 +1,195 @@
+// msgpool.cpp - slab allocated message buffers with per-thread caches
+
+#include <pthread.h>      // For pthread_mutex_t
+#include <stddef.h>       // For offsetof()
+#include "msgpool.h"
+
+// Shared free list of one size class
+struct PoolClass {
+	pthread_mutex_t lock;
+	MessageBuffer*  free_list;
+	uint32_t        free_count;
+	char*           slabs;       // Singly linked through the first word of each slab
+	uint64_t        slab_count;
+	uint64_t        buffer_count;
+	uint64_t        alloc_count;
+};
+
+// Free buffers owned by one thread, no locking
+struct PoolCache {
+	MessageBuffer* free_list[POOL_CLASSES];
+	uint32_t       free_count[POOL_CLASSES];
+	uint64_t       allocs[POOL_CLASSES];
+};
+
+#define POOL_CLASS_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0, 0 }
+static PoolClass pool_classes[POOL_CLASSES] = {
+	POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER,
+	POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER,
+	POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER, POOL_CLASS_INITIALIZER,
+};
+
+// Zero initialised for every thread, nothing to construct or destroy
+static thread_local PoolCache pool_cache;
+
+// Slabs start with a link to the next slab, buffers are 16-byte aligned after it
+static const size_t SLAB_HEADER = 16;
+
+static uint32_t classCapacity(int size_class)
+{
+	return (uint32_t)1 << (POOL_MIN_SHIFT + size_class);
+}
+
+static size_t bufferStride(int size_class)
+{
+	size_t size = offsetof(MessageBuffer, data) + classCapacity(size_class);
+	return (size + 15) & ~(size_t)15;
+}
+
+static int sizeClass(uint32_t len)
+{
+	int size_class = 0;
+	while (size_class < POOL_CLASSES - 1 && len > classCapacity(size_class)) {
+		size_class++;
+	}
+	return size_class;
+}
+
+// Called with the class lock held: carve a new slab into free buffers
+static void growClass(int size_class)
+{
+	PoolClass* pc = &pool_classes[size_class];
+	size_t stride = bufferStride(size_class);
+	size_t count = (POOL_SLAB_BYTES - SLAB_HEADER) / stride;
+	if (count < POOL_BATCH) {
+		count = POOL_BATCH;
+	}
+
+	char* slab = new char[SLAB_HEADER + count * stride];
+	*(char**)slab = pc->slabs;
+	pc->slabs = slab;
+	pc->slab_count++;
+	pc->buffer_count += count;
+
+	for (size_t i = 0; i < count; ++i) {
+		MessageBuffer* msg = (MessageBuffer*)(slab + SLAB_HEADER + i * stride);
+		msg->size_class = size_class;
+		msg->next = pc->free_list;
+		pc->free_list = msg;
+	}
+	pc->free_count += count;
+}
+
+MessageBuffer* poolAlloc(uint32_t len)
+{
+	int size_class = sizeClass(len);
+	PoolCache* cache = &pool_cache;
+
+	// Refill the cache with a batch from the shared list
+	if (cache->free_list[size_class] == NULL) {
+		PoolClass* pc = &pool_classes[size_class];
+		pthread_mutex_lock(&pc->lock);
+		if (pc->free_count < POOL_BATCH) {
+			growClass(size_class);
+		}
+		for (int i = 0; i < POOL_BATCH; ++i) {
+			MessageBuffer* msg = pc->free_list;
+			pc->free_list = msg->next;
+			msg->next = cache->free_list[size_class];
+			cache->free_list[size_class] = msg;
+		}
+		pc->free_count -= POOL_BATCH;
+		pc->alloc_count += cache->allocs[size_class];
+		pthread_mutex_unlock(&pc->lock);
+		cache->free_count[size_class] = POOL_BATCH;
+		cache->allocs[size_class] = 0;
+	}
+
+	MessageBuffer* msg = cache->free_list[size_class];
+	cache->free_list[size_class] = msg->next;
+	cache->free_count[size_class]--;
+	cache->allocs[size_class]++;
+	msg->next = NULL;
+	msg->len = len;
+	return msg;
+}
+
+// Moves count buffers from the front of the cache to the shared list
+static void releaseBuffers(PoolCache* cache, int size_class, uint32_t count)
+{
+	MessageBuffer* first = cache->free_list[size_class];
+	MessageBuffer* last = first;
+	for (uint32_t i = 1; i < count; ++i) {
+		last = last->next;
+	}
+	cache->free_list[size_class] = last->next;
+	cache->free_count[size_class] -= count;
+
+	PoolClass* pc = &pool_classes[size_class];
+	pthread_mutex_lock(&pc->lock);
+	last->next = pc->free_list;
+	pc->free_list = first;
+	pc->free_count += count;
+	pc->alloc_count += cache->allocs[size_class];
+	pthread_mutex_unlock(&pc->lock);
+	cache->allocs[size_class] = 0;
+}
+
+void poolFree(MessageBuffer* msg)
+{
+	int size_class = msg->size_class;
+	PoolCache* cache = &pool_cache;
+
+	msg->next = cache->free_list[size_class];
+	cache->free_list[size_class] = msg;
+	cache->free_count[size_class]++;
+
+	// The consumer frees what the reactors allocate: keep one batch, return the rest
+	if (cache->free_count[size_class] >= 2 * POOL_BATCH) {
+		releaseBuffers(cache, size_class, POOL_BATCH);
+	}
+}
+
+void poolFlushCache()
+{
+	PoolCache* cache = &pool_cache;
+	for (int i = 0; i < POOL_CLASSES; ++i) {
+		if (cache->free_count[i] > 0) {
+			releaseBuffers(cache, i, cache->free_count[i]);
+		}
+		else if (cache->allocs[i] > 0) {
+			pthread_mutex_lock(&pool_classes[i].lock);
+			pool_classes[i].alloc_count += cache->allocs[i];
+			pthread_mutex_unlock(&pool_classes[i].lock);
+			cache->allocs[i] = 0;
+		}
+	}
+}
+
+void poolStats(int size_class, PoolClassStats* stats)
+{
+	PoolClass* pc = &pool_classes[size_class];
+	pthread_mutex_lock(&pc->lock);
+	stats->capacity = classCapacity(size_class);
+	stats->slabs = pc->slab_count;
+	stats->buffers = pc->buffer_count;
+	stats->allocs = pc->alloc_count;
+	pthread_mutex_unlock(&pc->lock);
+}
+
+void poolDestroy()
+{
+	poolFlushCache();
+	for (int i = 0; i < POOL_CLASSES; ++i) {
+		PoolClass* pc = &pool_classes[i];
+		pthread_mutex_lock(&pc->lock);
+		while (pc->slabs != NULL) {
+			char* slab = pc->slabs;
+			pc->slabs = *(char**)slab;
+			delete[] slab;
+		}
+		pc->free_list = NULL;
+		pc->free_count = 0;
+		pthread_mutex_unlock(&pc->lock);
+	}
+}
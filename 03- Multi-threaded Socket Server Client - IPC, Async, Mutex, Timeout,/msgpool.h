@@ -0,0 +1,52 @@
+// msgpool.h - pooled message buffers for the reactor -> main thread pipeline
+//
+// Messages are carried in fixed-size buffers cut from large slabs, in
+// power-of-two size classes. Each thread keeps a small cache of free buffers
+// per class and exchanges them with a shared free list in batches, so a reactor allocating
+// and the main thread freeing only take the shared lock once per batch. Slabs
+// are only allocated while the pool grows; in steady state every message
+// reuses a buffer.
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+
+#include <stdint.h>
+
+#define POOL_MIN_SHIFT 8          // Smallest class holds 256 payload bytes
+#define POOL_CLASSES 9            // 256 B ... 64 KB, the largest frame payload
+#define POOL_SLAB_BYTES 262144    // Memory carved into buffers per slab allocation
+#define POOL_BATCH 32             // Buffers moved between a thread cache and the shared list
+
+// A message and its handle: only the pointer travels through the queue
+struct MessageBuffer {
+	MessageBuffer* next;         // Free list link while the buffer is unused
+	uint64_t       enqueue_ns;   // CLOCK_MONOTONIC time the message was queued
+	uint32_t       len;          // Payload bytes in data
+	uint32_t       size_class;
+	int32_t        owner;        // Set by the user, e.g. the connection the message came from
+	char           data[];       // Class capacity follows
+};
+
+// Counters for one size class, read at shutdown
+struct PoolClassStats {
+	uint32_t capacity;   // Payload bytes per buffer
+	uint64_t slabs;      // Slab allocations
+	uint64_t buffers;    // Buffers created from those slabs
+	uint64_t allocs;     // poolAlloc() calls served by this class
+};
+
+// Returns a buffer with room for len payload bytes (len <= MAX_FRAME_PAYLOAD).
+MessageBuffer* poolAlloc(uint32_t len);
+
+// Returns a buffer to the calling thread's cache. Any thread may free.
+void poolFree(MessageBuffer* msg);
+
+// Hands the calling thread's cached buffers back to the shared lists. Call
+// before a thread exits so its buffers are not stranded.
+void poolFlushCache();
+
+void poolStats(int size_class, PoolClassStats* stats);
+
+// Releases every slab. No buffer may be in use.
+void poolDestroy();
+
+#endif//MSGPOOL_H
@@ -0,0 +1,48 @@
+// msgqueue.cpp - eventfd wakeups for the message queue consumer
+
+#include <errno.h>        // For errno
+#include <poll.h>         // For poll()
+#include <sys/eventfd.h>  // For eventfd()
+#include <unistd.h>       // For read(), write(), close()
+#include "msgqueue.h"
+
+int wakerInit(QueueWaker* waker)
+{
+	waker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	waker->waiting.store(false);
+	return waker->event_fd < 0 ? -1 : 0;
+}
+
+void wakerClose(QueueWaker* waker)
+{
+	close(waker->event_fd);
+}
+
+void wakerNotify(QueueWaker* waker)
+{
+	// Order the push before reading the flag, pairs with the fence in wakerWait()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (waker->waiting.load(std::memory_order_relaxed) && waker->waiting.exchange(false)) {
+		uint64_t one = 1;
+		while (write(waker->event_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+		}
+	}
+}
+
+void wakerWait(QueueWaker* waker, bool (*is_empty)(void*), void* arg, int timeout_ms)
+{
+	waker->waiting.store(true, std::memory_order_relaxed);
+	// A producer that pushed before this fence is seen by is_empty(), one that
+	// pushes after it sees waiting == true and writes the eventfd.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (is_empty(arg)) {
+		struct pollfd pfd;
+		pfd.fd = waker->event_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout_ms) > 0) {
+			uint64_t count;
+			read(waker->event_fd, &count, sizeof(count));
+		}
+	}
+	waker->waiting.store(false, std::memory_order_relaxed);
+}
@@ -0,0 +1,121 @@
+// msgqueue.h - bounded lock-free multi-producer/single-consumer queue
+//
+// Ring of cells, each carrying a sequence number (D. Vyukov's bounded queue).
+// Producers claim a position with one compare-and-swap and publish the cell by
+// advancing its sequence; the single consumer needs no atomic read-modify-write.
+// QueueWaker lets the consumer sleep on an eventfd while the queue is empty.
+#ifndef MSGQUEUE_H
+#define MSGQUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+template <typename T>
+class MpscQueue {
+public:
+	// capacity must be a power of two
+	explicit MpscQueue(size_t capacity)
+		: cells(new Cell[capacity]), mask(capacity - 1), enqueue_pos(0), dequeue_pos(0)
+	{
+		for (size_t i = 0; i < capacity; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~MpscQueue()
+	{
+		delete[] cells;
+	}
+
+	// Any thread. Returns false when the queue is full.
+	bool push(T&& item)
+	{
+		Cell* cell;
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				// Cell is free for this lap, try to claim the position
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				// The consumer has not yet freed this cell: full
+				return false;
+			}
+			else {
+				// Another producer took this position, reload
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(item);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer thread only. Returns false when the queue is empty.
+	bool pop(T& item)
+	{
+		Cell* cell = &cells[dequeue_pos & mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(dequeue_pos + 1) < 0) {
+			return false;
+		}
+		item = std::move(cell->data);
+		// Hand the cell back to the producers for the next lap
+		cell->sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+		dequeue_pos++;
+		return true;
+	}
+
+	// Consumer thread only.
+	bool empty() const
+	{
+		const Cell* cell = &cells[dequeue_pos & mask];
+		return cell->sequence.load(std::memory_order_acquire) != dequeue_pos + 1;
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	Cell* const cells;
+	const size_t mask;
+	// Producers and the consumer write different cache lines
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) size_t dequeue_pos;
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+};
+
+// eventfd based wakeup. Producers only pay for a write() when the consumer
+// has announced that it is about to sleep.
+struct QueueWaker {
+	int               event_fd;
+	std::atomic<bool> waiting;
+};
+
+int wakerInit(QueueWaker* waker);
+void wakerClose(QueueWaker* waker);
+
+// Producer side, call after a successful push().
+void wakerNotify(QueueWaker* waker);
+
+// Consumer side. Sets the waiting flag, then calls is_empty(arg) once more and
+// sleeps for up to timeout_ms only if the queue is still empty.
+void wakerWait(QueueWaker* waker, bool (*is_empty)(void*), void* arg, int timeout_ms);
+
+#endif//MSGQUEUE_H
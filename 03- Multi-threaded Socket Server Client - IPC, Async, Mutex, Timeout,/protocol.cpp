@@ -0,0 +1,266 @@
+// protocol.cpp - length-prefixed message framing
+
+#include <arpa/inet.h>    // For htonl(), ntohl()
+#include <errno.h>        // For errno
+#include <stdlib.h>       // For realloc(), free()
+#include <string.h>       // For memcpy(), memmove()
+#include <sys/socket.h>   // For send(), sendmsg(), MSG_NOSIGNAL
+#include <sys/uio.h>      // For struct iovec
+#include "protocol.h"
+
+static uint32_t peekHeader(const char* header)
+{
+	uint32_t word;
+	memcpy(&word, header, FRAME_HEADER_SIZE);
+	return ntohl(word);
+}
+
+static uint32_t peekLength(const char* header)
+{
+	return peekHeader(header) & ~FRAME_FLAGS;
+}
+
+void parserInit(FrameParser* parser)
+{
+	parser->buffer = NULL;
+	parser->capacity = 0;
+	parser->start = 0;
+	parser->end = 0;
+}
+
+void parserFree(FrameParser* parser)
+{
+	free(parser->buffer);
+	parserInit(parser);
+}
+
+void parserReset(FrameParser* parser)
+{
+	if (parser->capacity > PARSER_INITIAL_SIZE) {
+		parserFree(parser);
+		return;
+	}
+	parser->start = 0;
+	parser->end = 0;
+}
+
+char* parserSpace(FrameParser* parser, uint32_t* space)
+{
+	// Nothing pending, start again at the front of the buffer
+	if (parser->start == parser->end) {
+		parser->start = 0;
+		parser->end = 0;
+	}
+
+	// Room needed for the frame currently being assembled
+	uint32_t needed = FRAME_HEADER_SIZE;
+	if (parser->end - parser->start >= FRAME_HEADER_SIZE) {
+		uint32_t len = peekLength(parser->buffer + parser->start);
+		if (len <= MAX_FRAME_PAYLOAD) {
+			needed += len;
+		}
+	}
+
+	// Move the partial frame to the front when it would not fit in the tail
+	if (parser->start > 0 && (parser->capacity - parser->start < needed || parser->end == parser->capacity)) {
+		memmove(parser->buffer, parser->buffer + parser->start, parser->end - parser->start);
+		parser->end -= parser->start;
+		parser->start = 0;
+	}
+
+	// Grow when the frame is larger than the whole buffer
+	if (parser->capacity < needed || parser->buffer == NULL) {
+		uint32_t capacity = parser->capacity ? parser->capacity : PARSER_INITIAL_SIZE;
+		while (capacity < needed) {
+			capacity *= 2;
+		}
+		char* buffer = (char*)realloc(parser->buffer, capacity);
+		if (buffer == NULL) {
+			*space = 0;
+			return NULL;
+		}
+		parser->buffer = buffer;
+		parser->capacity = capacity;
+	}
+
+	*space = parser->capacity - parser->end;
+	return parser->buffer + parser->end;
+}
+
+void parserCommit(FrameParser* parser, uint32_t len)
+{
+	parser->end += len;
+}
+
+int parserNext(FrameParser* parser, const char** payload, uint32_t* len, uint32_t* flags)
+{
+	uint32_t available = parser->end - parser->start;
+	if (available < FRAME_HEADER_SIZE) {
+		return 0;
+	}
+
+	uint32_t header = peekHeader(parser->buffer + parser->start);
+	uint32_t frame_len = header & ~FRAME_FLAGS;
+	if (frame_len > MAX_FRAME_PAYLOAD) {
+		return -1;
+	}
+	if (available < FRAME_HEADER_SIZE + frame_len) {
+		return 0;
+	}
+
+	*payload = parser->buffer + parser->start + FRAME_HEADER_SIZE;
+	*len = frame_len;
+	if (flags != nullptr) {
+		*flags = header & FRAME_FLAGS;
+	}
+	parser->start += FRAME_HEADER_SIZE + frame_len;
+	return 1;
+}
+
+void outputInit(OutputBuffer* out)
+{
+	out->buffer = NULL;
+	out->capacity = 0;
+	out->start = 0;
+	out->end = 0;
+}
+
+void outputFree(OutputBuffer* out)
+{
+	free(out->buffer);
+	outputInit(out);
+}
+
+void outputReset(OutputBuffer* out)
+{
+	if (out->capacity > PARSER_INITIAL_SIZE) {
+		outputFree(out);
+		return;
+	}
+	out->start = 0;
+	out->end = 0;
+}
+
+// Makes room for needed more bytes and returns where they go, or NULL when
+// the buffer would exceed OUTPUT_MAX_PENDING or memory runs out
+static char* outputReserve(OutputBuffer* out, uint32_t needed)
+{
+	if (out->end - out->start + needed > OUTPUT_MAX_PENDING) {
+		return NULL;
+	}
+
+	// Reclaim the space already sent before growing
+	if (out->start > 0 && out->capacity - out->end < needed) {
+		memmove(out->buffer, out->buffer + out->start, out->end - out->start);
+		out->end -= out->start;
+		out->start = 0;
+	}
+	if (out->capacity - out->end < needed) {
+		uint32_t capacity = out->capacity ? out->capacity : PARSER_INITIAL_SIZE;
+		while (capacity - out->end < needed) {
+			capacity *= 2;
+		}
+		char* buffer = (char*)realloc(out->buffer, capacity);
+		if (buffer == NULL) {
+			return NULL;
+		}
+		out->buffer = buffer;
+		out->capacity = capacity;
+	}
+
+	char* space = out->buffer + out->end;
+	out->end += needed;
+	return space;
+}
+
+int outputFrame(OutputBuffer* out, const char* payload, uint32_t len, uint32_t flags)
+{
+	char* frame = outputReserve(out, FRAME_HEADER_SIZE + len);
+	if (frame == NULL) {
+		return -1;
+	}
+	frameHeader(frame, len, flags);
+	if (len > 0) {
+		memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+	}
+	return 0;
+}
+
+int outputResponse(OutputBuffer* out, const char* id, const char* body, uint32_t len)
+{
+	char* frame = outputReserve(out, FRAME_HEADER_SIZE + REQUEST_ID_SIZE + len);
+	if (frame == NULL) {
+		return -1;
+	}
+	frameHeader(frame, REQUEST_ID_SIZE + len, FRAME_RESPONSE);
+	memcpy(frame + FRAME_HEADER_SIZE, id, REQUEST_ID_SIZE);
+	if (len > 0) {
+		memcpy(frame + FRAME_HEADER_SIZE + REQUEST_ID_SIZE, body, len);
+	}
+	return 0;
+}
+
+int outputFlush(int fd, OutputBuffer* out)
+{
+	while (out->start < out->end) {
+		ssize_t sent = send(fd, out->buffer + out->start, out->end - out->start, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			return -1;
+		}
+		out->start += sent;
+	}
+	out->start = 0;
+	out->end = 0;
+	return 0;
+}
+
+void frameHeader(char* header, uint32_t len, uint32_t flags)
+{
+	uint32_t word = htonl(len | flags);
+	memcpy(header, &word, FRAME_HEADER_SIZE);
+}
+
+int writeFrame(int fd, const char* payload, uint32_t len)
+{
+	char header[FRAME_HEADER_SIZE];
+	frameHeader(header, len);
+
+	// Header and payload go out in one system call
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = FRAME_HEADER_SIZE;
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len = len;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		// Skip whatever was written and retry the remainder
+		while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,96 @@
+// protocol.h - length-prefixed message framing shared by the server and the clients
+//
+// Every message on the wire is a 4-byte length in network byte order followed by
+// that many payload bytes. TCP is a byte stream, so a single read() can return
+// part of a frame or several frames; FrameParser keeps the partial frame between
+// reads and hands out every complete one.
+//
+// Lengths never need more than 17 bits, so the top bits of the length word
+// carry the frame kind. A plain frame (no flags) is a message. A request frame
+// starts with an 8-byte id chosen by the client, and the server answers each
+// one with a response frame carrying the same id, followed by the echoed body
+// when the server echoes. Clients may have any number of requests outstanding;
+// responses on a connection come back in request order. With both bits set the
+// frame is a keepalive ping, which carries nothing and needs no answer.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+const uint32_t FRAME_HEADER_SIZE = 4;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;   // Larger frames are a protocol error
+const uint32_t PARSER_INITIAL_SIZE = 4096;      // Grown on demand up to one maximal frame
+const uint32_t OUTPUT_MAX_PENDING = 4 * 1024 * 1024;   // Unsent bytes allowed per connection
+const uint32_t OUTPUT_FLUSH_SIZE = 64 * 1024;   // Send early once this much is queued
+
+const uint32_t FRAME_REQUEST = 0x80000000u;    // Payload: request id, then the body
+const uint32_t FRAME_RESPONSE = 0x40000000u;   // Payload: request id, then the echoed body if any
+const uint32_t FRAME_FLAGS = FRAME_REQUEST | FRAME_RESPONSE;
+const uint32_t FRAME_PING = FRAME_FLAGS;
+const uint32_t REQUEST_ID_SIZE = 8;
+
+struct FrameParser {
+	char*    buffer;     // Allocated on first use
+	uint32_t capacity;
+	uint32_t start;      // First unparsed byte
+	uint32_t end;        // One past the last received byte
+};
+
+// Frames waiting to be sent on a non-blocking socket. Frames are appended
+// while a batch of input is handled and leave together in one send().
+struct OutputBuffer {
+	char*    buffer;     // Allocated on first use
+	uint32_t capacity;
+	uint32_t start;      // First unsent byte
+	uint32_t end;        // One past the last queued byte
+};
+
+void parserInit(FrameParser* parser);
+void parserFree(FrameParser* parser);
+
+// Empties the parser for a new connection. A buffer of PARSER_INITIAL_SIZE is
+// kept for reuse; one that grew for a large frame is released.
+void parserReset(FrameParser* parser);
+
+// Returns where the next read() should store data and how much room there is.
+// Compacts or grows the buffer so the frame being assembled always fits.
+char* parserSpace(FrameParser* parser, uint32_t* space);
+
+// Records that len bytes were stored at the pointer returned by parserSpace().
+void parserCommit(FrameParser* parser, uint32_t len);
+
+// Extracts the next complete frame. Returns 1 and sets payload/len (and flags,
+// when asked for) when a frame is available, 0 when more data is needed, -1 on
+// a malformed (oversized) frame. Request and response payloads include the id.
+// The payload pointer stays valid until the next call to parserSpace().
+int parserNext(FrameParser* parser, const char** payload, uint32_t* len, uint32_t* flags = nullptr);
+
+// Writes the 4-byte header for a payload of len bytes.
+void frameHeader(char* header, uint32_t len, uint32_t flags = 0);
+
+void outputInit(OutputBuffer* out);
+void outputFree(OutputBuffer* out);
+void outputReset(OutputBuffer* out);   // Like parserReset()
+
+// Queues one frame. Returns -1 when it would take the unsent data past
+// OUTPUT_MAX_PENDING or memory runs out.
+int outputFrame(OutputBuffer* out, const char* payload, uint32_t len, uint32_t flags = 0);
+
+// Queues the response to a request: its REQUEST_ID_SIZE byte id as received,
+// then len bytes of body (none for a plain acknowledgement). Fails like outputFrame().
+int outputResponse(OutputBuffer* out, const char* id, const char* body, uint32_t len);
+
+inline bool outputPending(const OutputBuffer* out) {
+	return out->end != out->start;
+}
+
+// Sends as much queued data as the socket takes without blocking. Returns 0
+// when everything was sent, 1 when the socket is full and data remains, -1
+// with errno set on a send error.
+int outputFlush(int fd, OutputBuffer* out);
+
+// Sends one complete frame on a blocking socket, retrying short writes.
+// Returns 0 on success, -1 with errno set on failure.
+int writeFrame(int fd, const char* payload, uint32_t len);
+
+#endif//PROTOCOL_H
@@ -0,0 +1,734 @@
+// reactor.cpp - edge-triggered epoll event loop for the TCP message server
+//
+// Each reactor thread waits on its own listening socket and every client socket
+// it accepted. Readiness is edge-triggered, so each notification is drained
+// until the kernel reports EAGAIN. Reactors share nothing but the wakeup of
+// the main thread.
+
+#include <iostream>       // For cout, cerr
+#include <pthread.h>      // For pthread_setaffinity_np(), pthread_setname_np()
+#include <stdio.h>        // For snprintf()
+#include <sched.h>        // For cpu_set_t
+#include <sys/epoll.h>    // For epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/socket.h>   // For accept4(), send(), getpeername()
+#include <arpa/inet.h>    // For inet_ntop()
+#include <unistd.h>       // For close(), read()
+#include <cstring>        // For strerror(), memcpy()
+#include <errno.h>        // For errno
+#include "server.h"
+
+using namespace std;
+
+// epoll user data for the listening socket. Connections use (generation << 32) | slot.
+static const uint64_t LISTEN_TAG = UINT64_MAX;
+
+static void connectionArmTimer(Reactor* reactor, int slot);
+
+static uint64_t connectionTag(Reactor* reactor, int slot)
+{
+	return ((uint64_t)reactor->connections[slot].generation << 32) | (uint32_t)slot;
+}
+
+void connectionClose(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+
+	// Closing the descriptor also removes it from the epoll set
+	close(conn->fd);
+	timerCancel(&reactor->timers, &conn->timer);
+	if (conn->throttled) {
+		// Still linked on the throttled list; connectionResumable() drops it
+		conn->throttled = false;
+		statAdd(reactor->stats.throttled_ns, nowNs() - conn->throttle_start_ns);
+	}
+	conn->fd = -1;
+	conn->generation++;
+	// Keep the receive buffer for the next client of this slot
+	parserReset(&conn->parser);
+	outputReset(&conn->out);
+
+	// Return the slot to the free list so the next client can reuse it
+	conn->next_free = reactor->free_head;
+	reactor->free_head = slot;
+	reactor->active--;
+	statAdd(reactor->stats.closed, 1);
+}
+
+int connectionOpen(Reactor* reactor, int client_fd)
+{
+	// Connection table is full, refuse the client
+	if (reactor->free_head < 0) {
+		cerr << "Connection table full, rejecting client" << endl;
+		close(client_fd);
+		return -1;
+	}
+
+	int slot = reactor->free_head;
+	Connection* conn = &reactor->connections[slot];
+	reactor->free_head = conn->next_free;
+	conn->fd = client_fd;
+	conn->next_free = -1;
+	conn->write_blocked = false;
+	conn->closing = false;
+	conn->recv_armed = false;
+	// Start from what the main thread has consumed so far. Messages of the
+	// slot's previous client may still be in the queue, so a new client can
+	// briefly be under-counted; the reactor budget still covers them.
+	conn->queued_bytes = conn->consumed_bytes.load(std::memory_order_relaxed);
+	conn->throttled = false;
+	conn->throttled_ns = 0;
+	conn->throttle_count = 0;
+	conn->reported_slow = false;
+
+	// Counters start over for every client of the slot
+	memset(&conn->stats, 0, sizeof(conn->stats));
+	conn->stats.connected_ns = nowNs();
+	conn->stats.last_active_ns = conn->stats.connected_ns;
+	socklen_t peer_len = sizeof(conn->stats.peer);
+	getpeername(client_fd, (struct sockaddr*)&conn->stats.peer, &peer_len);
+	statAdd(reactor->stats.syscalls, 1);
+	conn->last_ping_ns = 0;
+	connectionArmTimer(reactor, slot);
+
+	reactor->active++;
+	statAdd(reactor->stats.accepted, 1);
+	return slot;
+}
+
+// When the connection times out and when it is due a ping, in milliseconds
+// like the timer wheel, UINT64_MAX when not enabled
+static uint64_t connectionIdleDeadline(Connection* conn)
+{
+	return idle_timeout_ms > 0 ? conn->stats.last_active_ns / 1000000 + idle_timeout_ms : UINT64_MAX;
+}
+
+static uint64_t connectionPingDue(Connection* conn)
+{
+	if (keepalive_ms == 0) {
+		return UINT64_MAX;
+	}
+	uint64_t quiet_since = conn->last_ping_ns > conn->stats.last_active_ns ? conn->last_ping_ns : conn->stats.last_active_ns;
+	return quiet_since / 1000000 + keepalive_ms;
+}
+
+// Schedules the connection's timer for whichever comes first
+static void connectionArmTimer(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+	uint64_t idle_ms = connectionIdleDeadline(conn);
+	uint64_t ping_ms = connectionPingDue(conn);
+	uint64_t due_ms = idle_ms < ping_ms ? idle_ms : ping_ms;
+	if (due_ms != UINT64_MAX) {
+		timerSchedule(&reactor->timers, &conn->timer, due_ms);
+	}
+}
+
+// Queues the connection to be flushed at the end of this loop iteration
+static void connectionMarkDirty(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+	if (!conn->in_dirty_list) {
+		conn->in_dirty_list = true;
+		conn->next_dirty = reactor->dirty_head;
+		reactor->dirty_head = slot;
+	}
+}
+
+int connectionFrames(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+
+	// A single read can carry any number of frames, queue every complete one
+	const char* payload;
+	uint32_t len;
+	uint32_t flags;
+	int rc;
+	while ((rc = parserNext(&conn->parser, &payload, &len, &flags)) > 0) {
+		int answered = 0;
+		if (flags == FRAME_REQUEST && len >= REQUEST_ID_SIZE) {
+			// Answer with the same id; the body is what gets queued
+			const char* id = payload;
+			payload += REQUEST_ID_SIZE;
+			len -= REQUEST_ID_SIZE;
+			answered = outputResponse(&conn->out, id, payload, echo_messages ? len : 0);
+			statAdd(reactor->stats.requests, 1);
+		}
+		else if (flags == FRAME_PING) {
+			// Nothing to do, the read already counts as activity
+			continue;
+		}
+		else if (flags != 0) {
+			// Responses only go to clients, and a request needs its id
+			rc = -1;
+			break;
+		}
+		else if (echo_messages) {
+			answered = outputFrame(&conn->out, payload, len);
+		}
+		if (answered < 0) {
+			cerr << "Client is not reading its responses, closing it" << endl;
+			return -1;
+		}
+		pushMessage(reactor, slot, payload, len);
+		conn->stats.messages++;
+	}
+	if (rc < 0) {
+		// The connection is closed, so say here who it was
+		char name[32];
+		peerName(&conn->stats.peer, name, sizeof(name));
+		cerr << "Framing error from " << name << " after " << conn->stats.messages
+			<< " messages, closing client" << endl;
+		statAdd(reactor->stats.framing_errors, 1);
+		return rc;
+	}
+
+	if (!outputPending(&conn->out) || conn->write_blocked) {
+		return 0;
+	}
+	// Responses to everything read in this loop iteration leave together in
+	// one send() at its end, unless enough has piled up to send now
+	if (conn->out.end - conn->out.start >= OUTPUT_FLUSH_SIZE) {
+		return connectionFlush(reactor, slot) < 0 ? -1 : 0;
+	}
+	connectionMarkDirty(reactor, slot);
+	return 0;
+}
+
+int connectionExpired(Reactor* reactor)
+{
+	uint64_t now = nowNs();
+	uint64_t now_ms = now / 1000000;
+	Timer* timer;
+	while ((timer = wheelExpired(&reactor->timers, now_ms)) != NULL) {
+		if (timer->owner < 0) {
+			reactor->drain_expired = true;
+			continue;
+		}
+		int slot = timer->owner;
+		Connection* conn = &reactor->connections[slot];
+		if (conn->fd < 0 || conn->closing) {
+			continue;
+		}
+		// Compared in the wheel's milliseconds, so a timer that fired is never
+		// found not yet due and re-armed for the same tick
+		if (now_ms >= connectionIdleDeadline(conn)) {
+			statAdd(reactor->stats.idle_closes, 1);
+			return slot;
+		}
+		if (now_ms >= connectionPingDue(conn)) {
+			// A peer that went away without a FIN shows up as a send error
+			if (outputFrame(&conn->out, NULL, 0, FRAME_PING) < 0) {
+				return slot;
+			}
+			conn->last_ping_ns = now;
+			statAdd(reactor->stats.pings, 1);
+			connectionMarkDirty(reactor, slot);
+		}
+		// Data arrived since the timer was set, or a ping went out: go again
+		connectionArmTimer(reactor, slot);
+	}
+	return -1;
+}
+
+int connectionDirty(Reactor* reactor)
+{
+	while (reactor->dirty_head >= 0) {
+		int slot = reactor->dirty_head;
+		Connection* conn = &reactor->connections[slot];
+		reactor->dirty_head = conn->next_dirty;
+		conn->in_dirty_list = false;
+		// Closed (and maybe reused) since, or already sent by an early flush
+		if (conn->fd >= 0 && !conn->closing && !conn->write_blocked && outputPending(&conn->out)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+int connectionFlush(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+	uint32_t pending = conn->out.end - conn->out.start;
+
+	int rc = outputFlush(conn->fd, &conn->out);
+	uint32_t sent = pending - (conn->out.end - conn->out.start);
+	statAdd(reactor->stats.syscalls, 1);
+	statAdd(reactor->stats.writes, 1);
+	statAdd(reactor->stats.bytes_out, sent);
+	conn->stats.bytes_out += sent;
+	if (rc < 0) {
+		cerr << "Write error: " << strerror(errno) << endl;
+		return -1;
+	}
+	// Socket buffer full: the backend resumes once the socket is writable
+	conn->write_blocked = rc > 0;
+	return rc;
+}
+
+// Account for len bytes that arrived from a client, before they are parsed
+static void connectionReceived(Reactor* reactor, Connection* conn, uint32_t len)
+{
+	statAdd(reactor->stats.bytes_in, len);
+	histRecord(&reactor->read_sizes, len);
+	conn->stats.bytes_in += len;
+	conn->stats.last_active_ns = nowNs();
+}
+
+int connectionData(Reactor* reactor, int slot, const char* data, uint32_t len)
+{
+	Connection* conn = &reactor->connections[slot];
+	connectionReceived(reactor, conn, len);
+
+	// Copy in as much as fits and extract frames before copying the rest, so the
+	// parser never has to hold more than the frame being assembled
+	while (len > 0) {
+		uint32_t space;
+		char* buffer = parserSpace(&conn->parser, &space);
+		if (buffer == NULL) {
+			cerr << "Out of memory for client buffer" << endl;
+			return -1;
+		}
+		uint32_t chunk = len < space ? len : space;
+		memcpy(buffer, data, chunk);
+		parserCommit(&conn->parser, chunk);
+		data += chunk;
+		len -= chunk;
+		if (connectionFrames(reactor, slot) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Bytes a client, and the whole reactor, have waiting for the main thread
+static uint64_t connectionWaiting(Connection* conn)
+{
+	int64_t waiting = (int64_t)(conn->queued_bytes - conn->consumed_bytes.load(std::memory_order_relaxed));
+	return waiting > 0 ? (uint64_t)waiting : 0;
+}
+
+static uint64_t reactorWaiting(Reactor* reactor)
+{
+	int64_t waiting = (int64_t)(reactor->stats.queued_bytes.load(std::memory_order_relaxed)
+		- reactor->consumed_bytes.load(std::memory_order_relaxed));
+	return waiting > 0 ? (uint64_t)waiting : 0;
+}
+
+bool connectionThrottle(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+	if (conn->throttled) {
+		return true;
+	}
+	if (connectionWaiting(conn) <= connection_budget && reactorWaiting(reactor) <= reactor_budget) {
+		return false;
+	}
+
+	// Leave the data in the socket: once its receive buffer is full, TCP flow
+	// control stops the sender
+	conn->throttled = true;
+	conn->throttle_start_ns = nowNs();
+	conn->throttle_count++;
+	statAdd(reactor->stats.throttles, 1);
+	if (!conn->in_throttle_list) {
+		conn->in_throttle_list = true;
+		conn->next_throttled = reactor->throttled_head;
+		reactor->throttled_head = slot;
+	}
+	return true;
+}
+
+int connectionResumable(Reactor* reactor)
+{
+	uint64_t now = nowNs();
+	// Resume at half the budget so a client is not stopped again straight away
+	bool reactor_ok = reactorWaiting(reactor) <= reactor_budget / 2;
+
+	int* link = &reactor->throttled_head;
+	while (*link >= 0) {
+		int slot = *link;
+		Connection* conn = &reactor->connections[slot];
+		if (!conn->throttled) {
+			// Closed while throttled
+			*link = conn->next_throttled;
+			conn->in_throttle_list = false;
+			continue;
+		}
+		if (reactor_ok && connectionWaiting(conn) <= connection_budget / 2) {
+			*link = conn->next_throttled;
+			conn->in_throttle_list = false;
+			conn->throttled = false;
+			conn->throttled_ns += now - conn->throttle_start_ns;
+			statAdd(reactor->stats.throttled_ns, now - conn->throttle_start_ns);
+			return slot;
+		}
+		if (!conn->reported_slow && now - conn->throttle_start_ns >= SLOW_CLIENT_MS * 1000000ull) {
+			conn->reported_slow = true;
+			statAdd(reactor->stats.slow_clients, 1);
+			cerr << "Reactor " << reactor->id << ": client in slot " << slot << " throttled for over "
+				<< SLOW_CLIENT_MS << " ms, it sends faster than the server drains" << endl;
+		}
+		link = &conn->next_throttled;
+	}
+	return -1;
+}
+
+static void acceptConnections(Reactor* reactor)
+{
+	// Edge-triggered: accept until the backlog is empty
+	while (true) {
+		int client_fd = accept4(reactor->listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		statAdd(reactor->stats.syscalls, 1);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EWOULDBLOCK && errno != EAGAIN) {
+				cerr << "Accepting connection failed: " << strerror(errno) << endl;
+			}
+			return;
+		}
+
+		int slot = connectionOpen(reactor, client_fd);
+		if (slot < 0) {
+			continue;
+		}
+
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.u64 = connectionTag(reactor, slot);
+		statAdd(reactor->stats.syscalls, 1);
+		if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+			cerr << "Adding client to epoll failed: " << strerror(errno) << endl;
+			connectionClose(reactor, slot);
+		}
+	}
+}
+
+static void readConnection(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+
+	// Edge-triggered: read until the socket is empty
+	while (true) {
+		// Read straight into the connection's frame buffer, after any partial frame
+		uint32_t space;
+		char* buffer = parserSpace(&conn->parser, &space);
+		if (buffer == NULL) {
+			cerr << "Out of memory for client buffer" << endl;
+			connectionClose(reactor, slot);
+			return;
+		}
+
+		int num_bytes = read(conn->fd, buffer, space);
+		statAdd(reactor->stats.syscalls, 1);
+		if (num_bytes > 0) {
+			parserCommit(&conn->parser, num_bytes);
+			connectionReceived(reactor, conn, num_bytes);
+			if (connectionFrames(reactor, slot) < 0) {
+				connectionClose(reactor, slot);
+				return;
+			}
+			if (connectionThrottle(reactor, slot)) {
+				// Over budget, read the rest once the main thread catches up
+				return;
+			}
+			continue;
+		}
+		if (num_bytes == 0) {
+			// Client closed the connection
+			connectionClose(reactor, slot);
+			return;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EWOULDBLOCK || errno == EAGAIN) {
+			// Socket drained, wait for the next edge
+			return;
+		}
+		// Other errors, log and close the socket
+		cerr << "Read error: " << strerror(errno) << endl;
+		connectionClose(reactor, slot);
+		return;
+	}
+}
+
+int reactorInit(Reactor* reactor, int id, int listen_fd, int cpu, int backend)
+{
+	reactor->id = id;
+	reactor->cpu = cpu;
+	reactor->backend = backend;
+	reactor->listen_fd = listen_fd;
+	reactor->active = 0;
+	reactor->stats.accepted = 0;
+	reactor->stats.closed = 0;
+	reactor->stats.messages = 0;
+	reactor->stats.bytes_in = 0;
+	reactor->stats.bytes_out = 0;
+	reactor->stats.push_ns_total = 0;
+	reactor->stats.push_ns_max = 0;
+	reactor->stats.full_retries = 0;
+	reactor->stats.syscalls = 0;
+	reactor->stats.queued_bytes = 0;
+	reactor->stats.depth_max = 0;
+	reactor->stats.throttles = 0;
+	reactor->stats.throttled_ns = 0;
+	reactor->stats.slow_clients = 0;
+	reactor->stats.framing_errors = 0;
+	reactor->stats.requests = 0;
+	reactor->stats.writes = 0;
+	reactor->stats.idle_closes = 0;
+	reactor->stats.pings = 0;
+	reactor->stats.shutdown_closes = 0;
+	wheelInit(&reactor->timers, TIMER_TICK_MS, nowNs() / 1000000);
+	reactor->draining = false;
+	reactor->drain_expired = false;
+	timerInit(&reactor->drain_timer, -1);
+	histInit(&reactor->read_sizes);
+	reactor->report_requested = 0;
+	reactor->report_ready = 0;
+	reactor->report = NULL;
+	reactor->report_count = 0;
+	reactor->consumed_bytes = 0;
+	reactor->throttled_head = -1;
+	reactor->dirty_head = -1;
+
+	// Thread every slot onto the free list
+	reactor->connections = new Connection[MAX_NUMBER_CONNECTIONS];
+	for (int i = 0; i < MAX_NUMBER_CONNECTIONS; ++i) {
+		reactor->connections[i].fd = -1;
+		reactor->connections[i].generation = 0;
+		reactor->connections[i].next_free = i + 1 < MAX_NUMBER_CONNECTIONS ? i + 1 : -1;
+		reactor->connections[i].consumed_bytes = 0;
+		reactor->connections[i].throttled = false;
+		reactor->connections[i].in_throttle_list = false;
+		reactor->connections[i].in_dirty_list = false;
+		timerInit(&reactor->connections[i].timer, i);
+		parserInit(&reactor->connections[i].parser);
+		outputInit(&reactor->connections[i].out);
+	}
+	reactor->free_head = 0;
+	reactor->queue = new MpscQueue<MessageBuffer*>(MESSAGE_QUEUE_CAPACITY);
+
+	// The io_uring backend sets up its ring on its own thread
+	reactor->epoll_fd = -1;
+	if (backend != BACKEND_EPOLL) {
+		return 0;
+	}
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd < 0) {
+		cerr << "Error creating epoll instance: " << strerror(errno) << endl;
+		delete[] reactor->connections;
+		delete reactor->queue;
+		return -1;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u64 = LISTEN_TAG;
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+		cerr << "Adding listening socket to epoll failed: " << strerror(errno) << endl;
+		close(reactor->epoll_fd);
+		delete[] reactor->connections;
+		delete reactor->queue;
+		return -1;
+	}
+	return 0;
+}
+
+void reactorPin(Reactor* reactor)
+{
+	// Name the thread so per-thread CPU time shows up in top -H and /proc
+	char name[16];
+	snprintf(name, sizeof(name), "reactor%d", reactor->id);
+	pthread_setname_np(pthread_self(), name);
+
+	// Optionally keep this reactor on one CPU so its connections stay cache-hot
+	if (reactor->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(reactor->cpu, &cpus);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rc != 0) {
+			cerr << "Reactor " << reactor->id << ": pinning to CPU " << reactor->cpu
+				<< " failed: " << strerror(rc) << endl;
+		}
+	}
+}
+
+void* reactorThread(void* arg)
+{
+	Reactor* reactor = (Reactor*)arg;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+
+	reactorPin(reactor);
+
+	while (!reactorFinished(reactor)) {
+		reactorReport(reactor);
+
+		int count = epoll_wait(reactor->epoll_fd, events, MAX_EPOLL_EVENTS, reactorTimeout(reactor));
+		statAdd(reactor->stats.syscalls, 1);
+		// Interrupted by a signal: nothing to handle, but still check for shutdown below
+		if (count < 0 && errno != EINTR) {
+			cerr << "epoll_wait failed: " << strerror(errno) << endl;
+			break;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			uint64_t tag = events[i].data.u64;
+			if (tag == LISTEN_TAG) {
+				acceptConnections(reactor);
+				continue;
+			}
+
+			// Ignore events for a slot that was closed and reused earlier in this batch
+			int slot = (int)(uint32_t)tag;
+			Connection* conn = &reactor->connections[slot];
+			if (conn->fd < 0 || conn->generation != (uint32_t)(tag >> 32)) {
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && conn->write_blocked) {
+				// Room in the socket again, send the rest of the echoes
+				if (connectionFlush(reactor, slot) < 0) {
+					connectionClose(reactor, slot);
+					continue;
+				}
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !conn->throttled) {
+				// read() reports EOF and errors, so hang-ups go through the same path
+				readConnection(reactor, slot);
+			}
+		}
+
+		// Carry on reading clients that are back under budget
+		int slot;
+		while ((slot = connectionResumable(reactor)) >= 0) {
+			readConnection(reactor, slot);
+		}
+
+		// Idle clients are closed; pings go out with the other output below
+		while ((slot = connectionExpired(reactor)) >= 0) {
+			connectionClose(reactor, slot);
+		}
+
+		if (!is_running && !reactor->draining) {
+			// Stop accepting and tell every client to quit; the listening
+			// socket itself is closed by reactorClose()
+			epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL);
+			reactorDrain(reactor);
+		}
+
+		// One send() per client for everything this iteration produced
+		while ((slot = connectionDirty(reactor)) >= 0) {
+			if (connectionFlush(reactor, slot) < 0) {
+				connectionClose(reactor, slot);
+			}
+		}
+	}
+	poolFlushCache();
+	pthread_exit(NULL);
+}
+
+void reactorClose(Reactor* reactor)
+{
+	// Signal clients to quit and close their sockets
+	char quit[FRAME_HEADER_SIZE + 4];
+	frameHeader(quit, 4);
+	memcpy(quit + FRAME_HEADER_SIZE, "Quit", 4);
+
+	for (int i = 0; i < MAX_NUMBER_CONNECTIONS; ++i) {
+		if (reactor->connections[i].fd >= 0) {
+			// A draining reactor has told its clients already
+			if (!reactor->draining) {
+				send(reactor->connections[i].fd, quit, sizeof(quit), MSG_NOSIGNAL);
+			}
+			else {
+				statAdd(reactor->stats.shutdown_closes, 1);
+			}
+			connectionClose(reactor, i);
+		}
+		parserFree(&reactor->connections[i].parser);
+		outputFree(&reactor->connections[i].out);
+	}
+	if (reactor->epoll_fd >= 0) {
+		close(reactor->epoll_fd);
+	}
+	close(reactor->listen_fd);
+	delete[] reactor->connections;
+	delete reactor->queue;
+	delete[] reactor->report;
+}
+
+int reactorTimeout(Reactor* reactor)
+{
+	// Wake up at least once a second to check is_running, and often while
+	// throttled clients wait for the main thread to catch up
+	int timeout = reactor->throttled_head >= 0 ? THROTTLE_POLL_MS : 1000;
+	int timers = wheelTimeout(&reactor->timers, nowNs() / 1000000);
+	return timers >= 0 && timers < timeout ? timers : timeout;
+}
+
+void reactorDrain(Reactor* reactor)
+{
+	reactor->draining = true;
+	for (int i = 0; i < MAX_NUMBER_CONNECTIONS; ++i) {
+		Connection* conn = &reactor->connections[i];
+		if (conn->fd >= 0 && !conn->closing && outputFrame(&conn->out, "Quit", 4) == 0) {
+			connectionMarkDirty(reactor, i);
+		}
+	}
+	if (shutdown_grace_ms == 0) {
+		reactor->drain_expired = true;
+		return;
+	}
+	timerSchedule(&reactor->timers, &reactor->drain_timer, nowNs() / 1000000 + shutdown_grace_ms);
+}
+
+bool reactorFinished(Reactor* reactor)
+{
+	return reactor->draining && (reactor->active == 0 || reactor->drain_expired);
+}
+
+void peerName(const struct sockaddr_in* peer, char* name, size_t size)
+{
+	char address[INET_ADDRSTRLEN];
+	if (peer->sin_family != AF_INET || inet_ntop(AF_INET, &peer->sin_addr, address, sizeof(address)) == NULL) {
+		snprintf(name, size, "unknown");
+		return;
+	}
+	snprintf(name, size, "%s:%u", address, ntohs(peer->sin_port));
+}
+
+void reactorReport(Reactor* reactor)
+{
+	uint32_t requested = reactor->report_requested.load(std::memory_order_acquire);
+	if (requested == reactor->report_ready.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	// Copy everything while no connection can change, then hand it over
+	if (reactor->report == NULL) {
+		reactor->report = new ConnectionReport[MAX_NUMBER_CONNECTIONS];
+	}
+	uint64_t now = nowNs();
+	int count = 0;
+	for (int i = 0; i < MAX_NUMBER_CONNECTIONS; ++i) {
+		Connection* conn = &reactor->connections[i];
+		if (conn->fd < 0) {
+			continue;
+		}
+		ConnectionReport* entry = &reactor->report[count++];
+		entry->reactor = reactor->id;
+		entry->slot = i;
+		entry->stats = conn->stats;
+		entry->idle_ns = now - conn->stats.last_active_ns;
+		entry->waiting = connectionWaiting(conn);
+		entry->throttled = conn->throttled;
+	}
+	reactor->report_count = count;
+	reactor->report_read_sizes = reactor->read_sizes;
+	reactor->report_ready.store(requested, std::memory_order_release);
+}
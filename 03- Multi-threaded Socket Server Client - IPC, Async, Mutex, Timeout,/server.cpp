@@ -1,78 +1,392 @@
 #include <iostream>       // For cout, cerr
-#include <sys/socket.h>   // For socket(), bind(), listen(), accept()
+#include <algorithm>      // For sort()
+#include <sys/socket.h>   // For socket(), bind(), listen(), setsockopt()
+#include <sys/uio.h>      // For writev()
 #include <netinet/in.h>   // For sockaddr_in
-#include <unistd.h>       // For close(), read(), write(), sleep()
+#include <unistd.h>       // For close()
 #include <pthread.h>      // For pthread_create(), pthread_join()
-#include <cstring>        // For memset(), strerror()
+#include <cstring>        // For memset(), memcpy(), strerror()
 #include <arpa/inet.h>    // For inet_pton()
 #include <fcntl.h>        // For fcntl()
-#include <queue>          // For std::queue
+#include <sched.h>        // For sched_yield()
+#include <getopt.h>       // For getopt()
 #include <signal.h>       // For sigaction()
+#include <time.h>         // For clock_gettime()
+#include "server.h"
 
 
 using namespace std;
 
-#define SOCKET_PATH "127.0.0.1"
-#define BUFFER_SIZE 4096
-#define MAX_NUMBER_CONNECTIONS 3
+atomic<bool> is_running(true);
+bool echo_messages = false;
+int sink_fd = STDOUT_FILENO;   // Where received messages are written (-o)
+uint64_t idle_timeout_ms = 0;
+uint64_t keepalive_ms = 0;
+uint64_t shutdown_grace_ms = SHUTDOWN_GRACE_MS;
+uint64_t connection_budget = CONNECTION_BUDGET;
+uint64_t reactor_budget;
+QueueWaker message_waker;
+DeliveryStats delivery_stats;
+Histogram queue_latency;          // Enqueue-to-write, main thread only
 
-// Function prototype for the client receive thread.
-void* receiveThread(void* arg);
+// SIGUSR1 asks for a report; report_epoch numbers the requests sent to the reactors
+atomic<bool> report_wanted(false);
+static uint32_t report_epoch = 0;
+static bool report_pending = false;
 
-bool is_running = true;
-queue<string> message;
-pthread_mutex_t lock_x = PTHREAD_MUTEX_INITIALIZER;
+int reactor_count = 0;
+Reactor* reactors = NULL;
 
-// Signal handler: sets is_running to false on SIGINT (Ctrl-C)
+// Signal handler: sets is_running to false on SIGINT (Ctrl-C), asks for a
+// statistics report on SIGUSR1
 void signalHandler(int signal) {
 	if (signal == SIGINT) {
 		cout << "\nServer received CTRL-C Signal - shutting down" << endl;
 		is_running = false;
 	}
+	else if (signal == SIGUSR1) {
+		report_wanted = true;
+	}
 	else {
 		cout << endl << "Undefined signal received" << endl;
 	}
 }
 
+uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-int main(int argc, const char* argv[])
-{
-	// Verify port number is provided as argument
-	if (argc != 2) {
-		perror("Port Number should be provided as argument.\n");
-		exit(1);
+// Called by a reactor thread: push received data into the reactor's own
+// lock-free queue and wake the main thread if it is sleeping.
+void pushMessage(Reactor* reactor, int slot, const char* data, int len) {
+	// Copy the payload into a pooled buffer; only the pointer is queued
+	MessageBuffer* msg = poolAlloc(len);
+	memcpy(msg->data, data, len);
+	msg->owner = slot;
+	msg->enqueue_ns = nowNs();
+	uint64_t start = msg->enqueue_ns;
+
+	// Charge the client and the reactor until the main thread has printed it.
+	// Done before the push so the consumer can never give back more than was charged.
+	reactor->connections[slot].queued_bytes += len;
+	statAdd(reactor->stats.queued_bytes, len);
+	statMax(reactor->stats.depth_max,
+		reactor->stats.queued_bytes.load(memory_order_relaxed) - reactor->consumed_bytes.load(memory_order_relaxed));
+
+	// The queue is bounded. When the main thread falls behind, hold the reactor
+	// here until there is room rather than dropping the message.
+	while (!reactor->queue->push(std::move(msg))) {
+		statAdd(reactor->stats.full_retries, 1);
+		wakerNotify(&message_waker);
+		sched_yield();
 	}
+	wakerNotify(&message_waker);
 
-	// Configure signal handling for SIGINT
-	struct sigaction action;
-	action.sa_handler = signalHandler;
-	sigemptyset(&action.sa_mask);
-	action.sa_flags = 0;
-	sigaction(SIGINT, &action, nullptr);
+	uint64_t elapsed = nowNs() - start;
+	statAdd(reactor->stats.messages, 1);
+	statAdd(reactor->stats.push_ns_total, elapsed);
+	statMax(reactor->stats.push_ns_max, elapsed);
+}
+
+static bool messageQueueEmpty(void*) {
+	for (int i = 0; i < reactor_count; ++i) {
+		if (!reactors[i].queue->empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Write every iovec, resuming after short writes. Returns -1 on error.
+static int writevAll(int fd, struct iovec* iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		delivery_stats.writes++;
+		delivery_stats.bytes_written += written;
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+// Write a batch of messages, one per line, straight from their pooled buffers,
+// then release the buffers and give the budget back to their clients.
+static void writeBatch(MessageBuffer** batch, int* owners, int count) {
+	static char newline = '\n';
+	struct iovec iov[2 * OUTPUT_BATCH];
+	for (int i = 0; i < count; ++i) {
+		iov[2 * i].iov_base = batch[i]->data;
+		iov[2 * i].iov_len = batch[i]->len;
+		iov[2 * i + 1].iov_base = &newline;
+		iov[2 * i + 1].iov_len = 1;
+	}
+	if (writevAll(sink_fd, iov, 2 * count) < 0) {
+		if (delivery_stats.dropped == 0) {
+			cerr << "Writing messages failed: " << strerror(errno) << ", discarding them" << endl;
+		}
+		delivery_stats.dropped += count;
+	}
+
+	uint64_t now = nowNs();
+	for (int i = 0; i < count; ++i) {
+		MessageBuffer* msg = batch[i];
+		uint64_t latency = now - msg->enqueue_ns;
+		delivery_stats.delivered++;
+		delivery_stats.delivery_ns_total += latency;
+		histRecord(&queue_latency, latency);
+		if (latency > delivery_stats.delivery_ns_max) {
+			delivery_stats.delivery_ns_max = latency;
+		}
+		// Give the budget back, the reactor resumes a throttled client from these
+		Reactor* reactor = &reactors[owners[i]];
+		statAdd(reactor->connections[msg->owner].consumed_bytes, msg->len);
+		statAdd(reactor->consumed_bytes, msg->len);
+		// Back to this thread's cache; the pool returns it to the reactors in batches
+		poolFree(msg);
+	}
+}
+
+// Take everything the reactors have queued and write it in batches of up to
+// OUTPUT_BATCH messages per writev(). Messages of one connection always come
+// from the same reactor queue, so their order is preserved.
+static void drainQueues() {
+	MessageBuffer* batch[OUTPUT_BATCH];
+	int owners[OUTPUT_BATCH];
+	int count = 0;
+	for (int i = 0; i < reactor_count; ++i) {
+		while (reactors[i].queue->pop(batch[count])) {
+			owners[count] = i;
+			if (++count == OUTPUT_BATCH) {
+				writeBatch(batch, owners, count);
+				count = 0;
+			}
+		}
+	}
+	if (count > 0) {
+		writeBatch(batch, owners, count);
+	}
+}
+
+// One line of percentiles, values divided by unit
+static void printDistribution(ostream& out, const char* label, const Histogram* hist, double unit) {
+	out << label << ": " << hist->count << " samples";
+	if (hist->count > 0) {
+		out << ", p50 " << histPercentile(hist, 0.50) / unit << ", p90 " << histPercentile(hist, 0.90) / unit
+			<< ", p99 " << histPercentile(hist, 0.99) / unit << ", p99.9 " << histPercentile(hist, 0.999) / unit
+			<< ", max " << hist->max / unit;
+	}
+	out << endl;
+}
+
+// Print what the reactors collected for the current request: per-reactor
+// load, the two distributions and the clients that sent the most
+static void printReport(double seconds) {
+	cerr << "--- Statistics after " << seconds << " s ---" << endl;
+	Histogram read_sizes;
+	histInit(&read_sizes);
+	int open = 0;
+	for (int i = 0; i < reactor_count; ++i) {
+		Reactor* reactor = &reactors[i];
+		ReactorStats& stats = reactor->stats;
+		cerr << "Reactor " << i << ": " << reactor->report_count << " open, " << stats.accepted.load() << " accepted, "
+			<< stats.messages.load() << " messages, " << stats.bytes_in.load() << " bytes in, "
+			<< stats.bytes_out.load() << " bytes out, " << stats.framing_errors.load() << " framing errors" << endl;
+		histMerge(&read_sizes, &reactor->report_read_sizes);
+		open += reactor->report_count;
+	}
+	printDistribution(cerr, "Read size (bytes)", &read_sizes, 1);
+	printDistribution(cerr, "Queue latency (us)", &queue_latency, 1000);
+
+	// Noisy clients first
+	ConnectionReport** entries = new ConnectionReport*[open > 0 ? open : 1];
+	int count = 0;
+	for (int i = 0; i < reactor_count; ++i) {
+		for (int j = 0; j < reactors[i].report_count; ++j) {
+			entries[count++] = &reactors[i].report[j];
+		}
+	}
+	sort(entries, entries + count, [](const ConnectionReport* a, const ConnectionReport* b) {
+		return a->stats.bytes_in > b->stats.bytes_in;
+	});
+	if (count > REPORT_TOP_CONNECTIONS) {
+		cerr << "Top " << REPORT_TOP_CONNECTIONS << " of " << count << " connections by bytes received:" << endl;
+		count = REPORT_TOP_CONNECTIONS;
+	}
+	else {
+		cerr << count << " connection(s) by bytes received:" << endl;
+	}
+	uint64_t now = nowNs();
+	for (int i = 0; i < count; ++i) {
+		ConnectionReport* entry = entries[i];
+		char name[32];
+		peerName(&entry->stats.peer, name, sizeof(name));
+		cerr << "  " << name << " (reactor " << entry->reactor << " slot " << entry->slot << "): "
+			<< entry->stats.bytes_in << " bytes in, " << entry->stats.bytes_out << " bytes out, "
+			<< entry->stats.messages << " messages, idle " << entry->idle_ns / 1000000 << " ms, connected "
+			<< (now - entry->stats.connected_ns) / 1e9 << " s, "
+			<< entry->waiting << " bytes queued" << (entry->throttled ? ", throttled" : "") << endl;
+	}
+	delete[] entries;
+}
+
+// Ask the reactors for a report on SIGUSR1 and print it once every reactor
+// has answered. Reactors answer at the top of their loop, within a second.
+static void serveReport(uint64_t started) {
+	if (!report_pending && report_wanted.exchange(false)) {
+		report_epoch++;
+		for (int i = 0; i < reactor_count; ++i) {
+			reactors[i].report_requested.store(report_epoch, memory_order_release);
+		}
+		report_pending = true;
+	}
+	if (!report_pending) {
+		return;
+	}
+	for (int i = 0; i < reactor_count; ++i) {
+		if (reactors[i].report_ready.load(memory_order_acquire) != report_epoch) {
+			return;
+		}
+	}
+	report_pending = false;
+	printReport((nowNs() - started) / 1e9);
+}
+
+// Sum the per-reactor counters. Each reactor only ever writes its own
+// counters, so reading them here needs no lock.
+static void printStats(double seconds) {
+	uint64_t accepted = 0, messages = 0, bytes = 0, bytes_out = 0, push_ns = 0, push_max = 0, full = 0, syscalls = 0;
+	uint64_t framing_errors = 0, requests = 0, writes = 0, idle_closes = 0, pings = 0, shutdown_closes = 0;
+	Histogram read_sizes;
+	histInit(&read_sizes);
+	for (int i = 0; i < reactor_count; ++i) {
+		ReactorStats& stats = reactors[i].stats;
+		cout << "Reactor " << i << ": " << stats.accepted.load() << " accepted, "
+			<< stats.messages.load() << " messages, " << stats.bytes_in.load() << " bytes" << endl;
+		if (stats.throttles.load() > 0) {
+			cout << "  backpressure: max depth " << stats.depth_max.load() / 1024 << " KB, "
+				<< stats.throttles.load() << " throttles, " << stats.throttled_ns.load() / 1000000 << " ms throttled, "
+				<< stats.slow_clients.load() << " slow client(s)" << endl;
+		}
+		accepted += stats.accepted.load();
+		messages += stats.messages.load();
+		bytes += stats.bytes_in.load();
+		bytes_out += stats.bytes_out.load();
+		push_ns += stats.push_ns_total.load();
+		full += stats.full_retries.load();
+		syscalls += stats.syscalls.load();
+		framing_errors += stats.framing_errors.load();
+		requests += stats.requests.load();
+		writes += stats.writes.load();
+		idle_closes += stats.idle_closes.load();
+		pings += stats.pings.load();
+		shutdown_closes += stats.shutdown_closes.load();
+		histMerge(&read_sizes, &reactors[i].read_sizes);
+		if (stats.push_ns_max.load() > push_max) {
+			push_max = stats.push_ns_max.load();
+		}
+	}
+
+	cout << "Total: " << accepted << " accepted (" << (uint64_t)(accepted / seconds) << "/s), "
+		<< messages << " messages (" << (uint64_t)(messages / seconds) << "/s), "
+		<< bytes << " bytes over " << seconds << " s" << endl;
+	if (bytes_out > 0) {
+		cout << "Sent " << bytes_out << " bytes of echoes and responses in " << writes << " send() calls";
+		if (requests > 0) {
+			cout << ", " << requests << " requests answered (" << (double)requests / writes << " per call)";
+		}
+		cout << endl;
+	}
+	if (framing_errors > 0) {
+		cout << "Framing errors: " << framing_errors << endl;
+	}
+	if (idle_closes > 0 || pings > 0 || shutdown_closes > 0) {
+		cout << "Timers: " << idle_closes << " idle clients closed, " << pings << " keepalive pings, "
+			<< shutdown_closes << " clients still connected at the shutdown deadline" << endl;
+	}
+	printDistribution(cout, "Read size (bytes)", &read_sizes, 1);
+	cout << "Message queues: " << messages << " queued, " << delivery_stats.delivered << " delivered, "
+		<< full << " full retries" << endl;
+	if (messages > 0) {
+		cout << "  enqueue  avg " << push_ns / messages << " ns, max " << push_max << " ns" << endl;
+		cout << "  I/O system calls: " << syscalls << " (" << (double)syscalls / messages << " per message)" << endl;
+	}
+	if (delivery_stats.delivered > 0) {
+		cout << "  delivery avg " << delivery_stats.delivery_ns_total / delivery_stats.delivered / 1000
+			<< " us, max " << delivery_stats.delivery_ns_max / 1000 << " us" << endl;
+		printDistribution(cout, "  delivery (us)", &queue_latency, 1000);
+	}
+	if (delivery_stats.writes > 0) {
+		cout << "Output: " << delivery_stats.bytes_written << " bytes in " << delivery_stats.writes << " writev() calls ("
+			<< (double)delivery_stats.delivered / delivery_stats.writes << " messages per call)";
+		if (delivery_stats.dropped > 0) {
+			cout << ", " << delivery_stats.dropped << " messages dropped";
+		}
+		cout << endl;
+	}
 
+	// Slabs only grow while the number of messages in flight rises; after that
+	// every message reuses a pooled buffer
+	for (int i = 0; i < POOL_CLASSES; ++i) {
+		PoolClassStats pool;
+		poolStats(i, &pool);
+		if (pool.allocs > 0) {
+			cout << "Message pool " << pool.capacity << " B: " << pool.allocs << " messages, "
+				<< pool.buffers << " buffers in " << pool.slabs << " slab allocation(s)" << endl;
+		}
+	}
+}
+
+// Create one listening socket. SO_REUSEPORT lets every reactor bind its own
+// socket to the same port; the kernel balances new connections between them.
+static int createListenSocket(int port) {
 	// Create master (listening) socket
 	int server_socket = socket(AF_INET, SOCK_STREAM, 0);
 	if (server_socket < 0) {
 		perror("creating stream socket");
-		exit(1);
+		return -1;
+	}
+
+	// Allow an immediate restart while old connections are still in TIME_WAIT,
+	// and several listening sockets on one port
+	int reuse = 1;
+	setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		cerr << "Error setting SO_REUSEPORT: " << strerror(errno) << endl;
+		close(server_socket);
+		return -1;
 	}
 
 	// Set the master socket to non-blocking mode
-	// Retrieve the current socket flags  
+	// Retrieve the current socket flags
 	int socket_flags = fcntl(server_socket, F_GETFL, 0);
-	// Handle error if unable to get socket flags  
+	// Handle error if unable to get socket flags
 	if (socket_flags == -1) {
 		cerr << "Error getting socket flags: " << strerror(errno) << endl;
 		close(server_socket);
-		exit(1);
+		return -1;
 	}
 
-	// Set the socket to non-blocking mode by adding the O_NONBLOCK flag 
+	// Set the socket to non-blocking mode by adding the O_NONBLOCK flag
 	if (fcntl(server_socket, F_SETFL, socket_flags | O_NONBLOCK) == -1) {
-		// Handle error if unable to set non-blocking mode  
+		// Handle error if unable to set non-blocking mode
 		cerr << "Error setting socket to non-blocking mode: " << strerror(errno) << endl;
 		close(server_socket);
-		exit(1);
+		return -1;
 	}
 
 	// Set up the server address structure (IPv4, localhost, port from argv)
@@ -80,120 +394,195 @@ int main(int argc, const char* argv[])
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	inet_pton(AF_INET, SOCKET_PATH, &server_addr.sin_addr);
-	server_addr.sin_port = htons(atoi(argv[1]));
+	server_addr.sin_port = htons(port);
 
 	// Bind the master socket to the specified address and port
 	if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(struct sockaddr_in)) < 0) {
 		perror("binding stream socket failed");
 		close(server_socket);
-		exit(1);
+		return -1;
 	}
 
 	//  Listen for incoming connections
-	if (listen(server_socket, MAX_NUMBER_CONNECTIONS) < 0) {
+	if (listen(server_socket, LISTEN_BACKLOG) < 0) {
 		perror("Server listen failed\n");
 		close(server_socket);
-		exit(1);
+		return -1;
 	}
+	return server_socket;
+}
 
-	printf("Waiting for incoming connection...\n");
+static void usage() {
+	cerr << "usage: server [-r reactors] [-p] [-b epoll|uring] [-e] [-m KB] [-M MB] [-o file]" << endl;
+	cerr << "              [-i seconds] [-k seconds] [-g seconds] <port number>" << endl;
+	cerr << "  -r reactors  number of event loops (default: one per online CPU)" << endl;
+	cerr << "  -p           pin reactor i to CPU i" << endl;
+	cerr << "  -b backend   I/O backend: epoll (default) or uring" << endl;
+	cerr << "  -e           echo every message back to its client" << endl;
+	cerr << "  -m KB        queued bytes allowed per client before it is throttled (default "
+		<< CONNECTION_BUDGET / 1024 << ")" << endl;
+	cerr << "  -M MB        queued bytes allowed over all clients (default " << (SERVER_BUDGET >> 20) << ")" << endl;
+	cerr << "  -o file      append received messages to file instead of standard output" << endl;
+	cerr << "  -i seconds   close clients that send nothing for this long (default: never)" << endl;
+	cerr << "  -k seconds   ping clients that have been quiet this long (default: never)" << endl;
+	cerr << "  -g seconds   on shutdown, time clients get to leave after Quit (default "
+		<< SHUTDOWN_GRACE_MS / 1000.0 << ")" << endl;
+}
 
-	int active_clients = 0;
-	int client_sockets[MAX_NUMBER_CONNECTIONS];
-	pthread_t client_threads[MAX_NUMBER_CONNECTIONS];
 
-	while (is_running) {
-		// Accept new client if limit not reached
-		if (active_clients < MAX_NUMBER_CONNECTIONS) {
-			client_sockets[active_clients] = accept(server_socket, nullptr, nullptr);
-			if (client_sockets[active_clients] < 0) {
-				// If no pending connection to accept, continue looping
-				if (errno == EWOULDBLOCK || errno == EAGAIN) {
-					continue;
-				}
-				else {
-					cerr << "Accepting connection failed: " << strerror(errno) << endl;
-					close(server_socket);
-					exit(1);
-				}
+int main(int argc, char* argv[])
+{
+	int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	reactor_count = cpus;
+	bool pin = false;
+	int backend = BACKEND_EPOLL;
+	uint64_t server_budget = SERVER_BUDGET;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "r:pb:em:M:o:i:k:g:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reactor_count = atoi(optarg);
+			break;
+		case 'p':
+			pin = true;
+			break;
+		case 'e':
+			echo_messages = true;
+			break;
+		case 'm':
+			connection_budget = strtoull(optarg, NULL, 10) << 10;
+			break;
+		case 'M':
+			server_budget = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'o':
+			sink_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+			if (sink_fd < 0) {
+				cerr << "Cannot open " << optarg << ": " << strerror(errno) << endl;
+				exit(1);
 			}
-			// Create a thread to handle socket reads from this client
-			if (pthread_create(&client_threads[active_clients], NULL, receiveThread, &client_sockets[active_clients]) != 0) {
-				cout << "Failed to create receive thread" << strerror(errno) << endl;
-				close(server_socket);
-				close(client_sockets[active_clients]);
+			break;
+		case 'i':
+			idle_timeout_ms = (uint64_t)(atof(optarg) * 1000);
+			break;
+		case 'k':
+			keepalive_ms = (uint64_t)(atof(optarg) * 1000);
+			break;
+		case 'g':
+			shutdown_grace_ms = (uint64_t)(atof(optarg) * 1000);
+			break;
+		case 'b':
+			if (strcmp(optarg, "epoll") == 0) {
+				backend = BACKEND_EPOLL;
+			}
+			else if (strcmp(optarg, "uring") == 0) {
+				backend = BACKEND_URING;
+			}
+			else {
+				usage();
 				exit(1);
 			}
-			active_clients++;
-		}
-		// Process and print messages from the message queue
-		while (!message.empty()) {
-			pthread_mutex_lock(&lock_x);
-			cout << message.front() << endl;
-			message.pop();
-			pthread_mutex_unlock(&lock_x);
+			break;
+		default:
+			usage();
+			exit(1);
 		}
-		
-		sleep(1);
 	}
 
-	// Gracefully shut down: signal clients to quit, join threads, and close sockets
-	for (int i = 0; i < active_clients; ++i) {
-		write(client_sockets[i], "Quit", strlen("Quit"));
-		pthread_join(client_threads[i], NULL);
-		close(client_sockets[i]);
+	// Verify port number is provided as argument
+	if (optind != argc - 1) {
+		perror("Port Number should be provided as argument.\n");
+		usage();
+		exit(1);
+	}
+	int port = atoi(argv[optind]);
+	if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+		cerr << "Number of reactors must be between 1 and " << MAX_REACTORS << endl;
+		exit(1);
 	}
 
-	cout << endl << "Server is shutting down..." << endl;
-	close(server_socket);
+	if (connection_budget == 0 || server_budget == 0) {
+		cerr << "Budgets must be at least 1" << endl;
+		exit(1);
+	}
+	// Each reactor polices its own share, so reactors never touch a shared counter
+	reactor_budget = server_budget / reactor_count;
 
-	return 0;
-}
+	// Configure signal handling for SIGINT
+	struct sigaction action;
+	action.sa_handler = signalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGUSR1, &action, nullptr);
+	// A sink that is a closed pipe reports EPIPE instead of killing the server
+	signal(SIGPIPE, SIG_IGN);
 
-void* receiveThread(void* arg) {
-	// Extract the client file descriptor from the argument  
-	int client_fd = *(int*)arg;
+	// The main thread sleeps on this eventfd while the message queues are empty
+	if (wakerInit(&message_waker) < 0) {
+		cerr << "Error creating eventfd: " << strerror(errno) << endl;
+		exit(1);
+	}
 
-	// Set a read timeout of 5 seconds on the client socket
-	// Create a timeval structure to specify the timeout duration
-	struct timeval tv;
-	tv.tv_sec = 5;  // Timeout after 5 seconds  
-	tv.tv_usec = 0; // No additional microseconds  
+	// One reactor per core, each with its own listening socket, connection
+	// table and output queue
+	reactors = new Reactor[reactor_count]();
+	for (int i = 0; i < reactor_count; ++i) {
+		int listen_fd = createListenSocket(port);
+		if (listen_fd < 0 || reactorInit(&reactors[i], i, listen_fd, pin ? i % cpus : -1, backend) < 0) {
+			exit(1);
+		}
+	}
 
-	// Apply the receive timeout option to the client socket  
-	// SOL_SOCKET indicates that the option is at the socket API level
-	// SO_RCVTIMEO sets the timeout value for receiving data
-	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+	// Both backends share the connection table, framing and output queues
+	void* (*thread_func)(void*) = backend == BACKEND_URING ? uringReactorThread : reactorThread;
+	for (int i = 0; i < reactor_count; ++i) {
+		if (pthread_create(&reactors[i].thread, NULL, thread_func, &reactors[i]) != 0) {
+			cout << "Failed to create reactor thread" << strerror(errno) << endl;
+			exit(1);
+		}
+	}
 
-	char buffer[BUFFER_SIZE];
+	printf("Waiting for incoming connection on %d %s reactor(s)...\n", reactor_count,
+		backend == BACKEND_URING ? "io_uring" : "epoll");
+	// Messages bypass stdio, so nothing printed through it may be left in its buffer
+	fflush(stdout);
+	uint64_t started = nowNs();
+	histInit(&queue_latency);
 
 	while (is_running) {
+		// Process and print messages from the message queues
+		drainQueues();
+		serveReport(started);
+		// Sleep until a reactor queues a message, waking once a second to check
+		// is_running, or sooner while reactors are still answering a report
+		wakerWait(&message_waker, messageQueueEmpty, NULL, report_pending ? 10 : 1000);
+	}
 
-		// Clear buffer
-		memset(buffer, 0, BUFFER_SIZE);
-		int num_bytes = read(client_fd, buffer, BUFFER_SIZE);
-		
-		if (num_bytes == -1) {
-			if (errno == EWOULDBLOCK || errno == EAGAIN) {
-				// No data available in non-blocking mode, try again later
-				continue;
-			}
-			else {
-				// Other errors, log and close the socket
-				cerr << "Read error: " << strerror(errno) << endl;
-				break;
-			}
-		} else if (num_bytes == 0) {
-			// Client closed the connection
-			break;
-		}
-		else {
-			// Push received message into the shared queue (protected by a mutex)
-			pthread_mutex_lock(&lock_x);
-			message.push(string(buffer));
-			pthread_mutex_unlock(&lock_x);
+	// Gracefully shut down: the reactors stop accepting, tell their clients to
+	// quit and give them the grace period to leave. Keep printing what they
+	// queue meanwhile, then close whatever is left.
+	for (int i = 0; i < reactor_count; ++i) {
+		while (pthread_tryjoin_np(reactors[i].thread, NULL) == EBUSY) {
+			drainQueues();
+			wakerWait(&message_waker, messageQueueEmpty, NULL, 10);
 		}
-
 	}
-	pthread_exit(NULL);
-}
\ No newline at end of file
+	drainQueues();
+	double seconds = (nowNs() - started) / 1e9;
+	for (int i = 0; i < reactor_count; ++i) {
+		reactorClose(&reactors[i]);
+	}
+
+	cout << endl << "Server is shutting down..." << endl;
+	printStats(seconds);
+	wakerClose(&message_waker);
+	delete[] reactors;
+	poolDestroy();
+
+	return 0;
+}
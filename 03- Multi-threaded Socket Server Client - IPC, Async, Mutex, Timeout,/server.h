@@ -0,0 +1,223 @@
+// server.h - shared declarations for the TCP message server
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "histogram.h"
+#include "msgpool.h"
+#include "msgqueue.h"
+#include "protocol.h"
+#include "timerwheel.h"
+
+#define SOCKET_PATH "127.0.0.1"
+#define MAX_NUMBER_CONNECTIONS 4096   // Size of each reactor's connection table
+#define MAX_REACTORS 256
+#define LISTEN_BACKLOG 1024           // Pending connections the kernel may queue
+#define MAX_EPOLL_EVENTS 256          // Events handled per epoll_wait() call
+#define MESSAGE_QUEUE_CAPACITY 65536  // Power of two
+#define CONNECTION_BUDGET (1u << 20)       // Default bytes one client may have queued
+#define SERVER_BUDGET (64ull << 20)        // Default bytes queued over all clients
+#define THROTTLE_POLL_MS 5                 // Budget re-check interval while a client is throttled
+#define SLOW_CLIENT_MS 1000                // Throttled this long in one go: report the client
+#define OUTPUT_BATCH 512                   // Messages per writev(), two iovecs each (IOV_MAX is 1024)
+#define REPORT_TOP_CONNECTIONS 20          // Busiest clients listed in a SIGUSR1 report
+#define TIMER_TICK_MS 100                  // Resolution of idle timeouts, pings and deadlines
+#define SHUTDOWN_GRACE_MS 1000             // Default time clients get to leave after "Quit"
+
+// What one client has done so far. Plain fields: only the owning reactor
+// touches them, the main thread sees copies taken for a report.
+struct ConnectionStats {
+	uint64_t    bytes_in;
+	uint64_t    bytes_out;
+	uint64_t    messages;
+	uint64_t    connected_ns;
+	uint64_t    last_active_ns;   // Last time data arrived from the client
+	struct sockaddr_in peer;
+};
+
+// One slot of the connection table. Slots are recycled through a free list
+// when clients disconnect.
+struct Connection {
+	int         fd;          // -1 while the slot is free
+	uint32_t    generation;  // Bumped on every reuse so stale epoll events are ignored
+	int         next_free;   // Free list link, -1 terminates the list
+	FrameParser parser;      // Partial frame carried over between reads, kept with the slot
+	OutputBuffer out;        // Echoes and responses not yet accepted by the socket
+	bool        write_blocked;   // Socket full, waiting until it is writable again
+	bool        in_dirty_list;   // Output queued this loop iteration, sent at its end
+	int         next_dirty;
+	bool        closing;     // io_uring: shut down, waiting for the last completion
+	bool        recv_armed;  // io_uring: a multishot recv is outstanding
+
+	// Backpressure. The reactor adds every queued message to queued_bytes, the
+	// main thread adds it to consumed_bytes once printed; the difference is what
+	// this client has waiting. Over budget the reactor stops reading the socket.
+	uint64_t    queued_bytes;
+	std::atomic<uint64_t> consumed_bytes;
+	bool        throttled;
+	bool        in_throttle_list;
+	int         next_throttled;
+	uint64_t    throttle_start_ns;
+	uint64_t    throttled_ns;     // Total over the life of the connection
+	uint32_t    throttle_count;
+	bool        reported_slow;
+
+	ConnectionStats stats;
+
+	// One timer covers both the idle timeout and keepalive pings. Reads only
+	// update stats.last_active_ns; the timer re-checks it when it fires.
+	Timer       timer;
+	uint64_t    last_ping_ns;
+};
+
+// Snapshot of one open connection, taken by its reactor for a report
+struct ConnectionReport {
+	int         reactor;
+	int         slot;
+	ConnectionStats stats;
+	uint64_t    idle_ns;      // Since the client last sent anything
+	uint64_t    waiting;      // Bytes queued for the main thread
+	bool        throttled;
+};
+
+// Counters owned by one reactor. Only the owning thread writes them (plain
+// load + store, no locked instructions); the main thread reads them to
+// aggregate, so no lock is shared between cores.
+struct alignas(64) ReactorStats {
+	std::atomic<uint64_t> accepted;
+	std::atomic<uint64_t> closed;
+	std::atomic<uint64_t> messages;
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> bytes_out;
+	std::atomic<uint64_t> push_ns_total;
+	std::atomic<uint64_t> push_ns_max;
+	std::atomic<uint64_t> full_retries;   // Pushes that found the queue full
+	std::atomic<uint64_t> syscalls;       // Accept/receive path system calls
+	std::atomic<uint64_t> queued_bytes;   // Bytes pushed to the queue
+	std::atomic<uint64_t> depth_max;      // Most bytes waiting at once
+	std::atomic<uint64_t> throttles;      // Times a client was stopped for being over budget
+	std::atomic<uint64_t> throttled_ns;   // Summed over all clients
+	std::atomic<uint64_t> slow_clients;   // Throttled for SLOW_CLIENT_MS in one go
+	std::atomic<uint64_t> framing_errors; // Connections closed for a malformed frame
+	std::atomic<uint64_t> requests;       // Request frames answered
+	std::atomic<uint64_t> writes;         // send() calls for echoes and responses
+	std::atomic<uint64_t> idle_closes;    // Clients closed by the idle timeout
+	std::atomic<uint64_t> pings;          // Keepalive pings sent
+	std::atomic<uint64_t> shutdown_closes;   // Clients still there at the shutdown deadline
+};
+
+// Enqueue-to-print latency and output cost, kept by the main thread only
+struct DeliveryStats {
+	uint64_t delivered;
+	uint64_t delivery_ns_total;
+	uint64_t delivery_ns_max;
+	uint64_t writes;          // writev() calls to the sink
+	uint64_t bytes_written;
+	uint64_t dropped;         // Messages lost to a failing sink
+};
+
+// I/O backends, selected at startup
+enum Backend {
+	BACKEND_EPOLL = 0,   // Edge-triggered epoll, reactor.cpp
+	BACKEND_URING = 1    // io_uring with multishot accept/recv, uring.cpp
+};
+
+// Event loop. Every reactor has its own SO_REUSEPORT listening socket,
+// connection table and output queue, and runs on its own thread; the kernel
+// spreads incoming connections across the listeners.
+struct Reactor {
+	int         id;
+	int         cpu;            // CPU to pin the thread to, -1 for no pinning
+	int         backend;        // Backend
+	pthread_t   thread;
+	int         epoll_fd;       // -1 for the io_uring backend
+	int         listen_fd;
+	Connection* connections;    // MAX_NUMBER_CONNECTIONS slots
+	int         free_head;      // First free slot, -1 when the table is full
+	int         active;         // Number of open connections
+	int         throttled_head; // Clients not being read, -1 when there are none
+	int         dirty_head;     // Clients with output to send at the end of this iteration
+	MpscQueue<MessageBuffer*>* queue;  // Pooled messages for the main thread
+	ReactorStats stats;
+	Histogram   read_sizes;     // Bytes per read() or recv completion
+	TimerWheel  timers;         // Connection timers and the shutdown deadline
+
+	// Shutdown: "Quit" has gone out, clients get until drain_timer to leave
+	bool        draining;
+	bool        drain_expired;
+	Timer       drain_timer;
+	alignas(64) std::atomic<uint64_t> consumed_bytes;   // Written by the main thread
+
+	// Reports. The main thread raises report_requested; at the top of its next
+	// loop the reactor copies its histogram and open connections into the
+	// report_* fields and answers by setting report_ready to the same value.
+	std::atomic<uint32_t> report_requested;
+	alignas(64) std::atomic<uint32_t> report_ready;
+	Histogram   report_read_sizes;
+	ConnectionReport* report;   // MAX_NUMBER_CONNECTIONS entries, allocated on first use
+	int         report_count;
+};
+
+extern std::atomic<bool> is_running;
+
+// Send every received frame back to its client (-e), for round-trip measurements.
+// Requests are answered either way: with their body when echoing, else with a bare ack.
+extern bool echo_messages;
+
+// Idle timeout (-i), keepalive interval (-k) and shutdown grace period (-g), 0 for off
+extern uint64_t idle_timeout_ms;
+extern uint64_t keepalive_ms;
+extern uint64_t shutdown_grace_ms;
+
+// Queued bytes allowed per client and per reactor (its share of the server budget)
+extern uint64_t connection_budget;
+extern uint64_t reactor_budget;
+
+// The main thread sleeps on this while every reactor queue is empty
+extern QueueWaker message_waker;
+
+// server.cpp
+uint64_t nowNs();
+void pushMessage(Reactor* reactor, int slot, const char* data, int len);
+
+// Single-writer counter update, see ReactorStats
+inline void statAdd(std::atomic<uint64_t>& counter, uint64_t value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void statMax(std::atomic<uint64_t>& counter, uint64_t value) {
+	if (value > counter.load(std::memory_order_relaxed)) {
+		counter.store(value, std::memory_order_relaxed);
+	}
+}
+
+// reactor.cpp - connection table, shared by both backends
+int connectionOpen(Reactor* reactor, int client_fd);   // Returns the slot, -1 if the table is full
+void connectionClose(Reactor* reactor, int slot);
+int connectionFrames(Reactor* reactor, int slot);      // Queue complete frames, -1 on framing error
+int connectionData(Reactor* reactor, int slot, const char* data, uint32_t len);
+int connectionFlush(Reactor* reactor, int slot);       // 0 sent, 1 socket full, -1 error
+bool connectionThrottle(Reactor* reactor, int slot);   // Over budget: stop reading, returns true
+int connectionResumable(Reactor* reactor);             // Next throttled slot back under budget, or -1
+int connectionDirty(Reactor* reactor);                 // Next slot with output to send, or -1
+int connectionExpired(Reactor* reactor);               // Sends due pings; next idle slot to close, or -1
+void peerName(const struct sockaddr_in* peer, char* name, size_t size);   // "a.b.c.d:port"
+
+// reactor.cpp - epoll backend
+int reactorInit(Reactor* reactor, int id, int listen_fd, int cpu, int backend);
+void reactorPin(Reactor* reactor);
+void* reactorThread(void* arg);
+void reactorClose(Reactor* reactor);
+void reactorReport(Reactor* reactor);   // Answer a pending report request, if any
+int reactorTimeout(Reactor* reactor);   // Milliseconds the event loop may sleep
+void reactorDrain(Reactor* reactor);    // Start shutting down: "Quit" to every client
+bool reactorFinished(Reactor* reactor); // Drained: every client left or the deadline passed
+
+// uring.cpp - io_uring backend
+void* uringReactorThread(void* arg);
+
+#endif//SERVER_H
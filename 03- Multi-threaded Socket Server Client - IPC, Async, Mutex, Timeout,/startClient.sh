@@ -1,6 +1,20 @@
-echo "usage: startClient.sh <port number>"
-./client1 $1 &
-sleep 1
-./client2 $1 &
-sleep 1
-./client3 $1 &
+echo "usage: startClient.sh <port number> [clients] [client options]"
+echo "  e.g. startClient.sh 8080 4 -c 16 -r 50000 -d 30 -e   (4 load generators)"
+PORT=$1
+CLIENTS=${2:-3}
+shift
+shift
+if [ $# -eq 0 ]; then
+	# Demo: three clients sending one message a second, started a second apart
+	./client1 $PORT &
+	sleep 1
+	./client2 $PORT &
+	sleep 1
+	./client3 $PORT &
+else
+	# Load generators, all started at once; each prints its own results
+	for i in $(seq 1 $CLIENTS); do
+		./client1 "$@" $PORT &
+	done
+	wait
+fi
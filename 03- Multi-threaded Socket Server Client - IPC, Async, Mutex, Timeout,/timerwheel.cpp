@@ -0,0 +1,185 @@
+// timerwheel.cpp - hierarchical timer wheel
+
+#include "timerwheel.h"
+
+static const uint64_t WHEEL_SPAN = (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+
+static void listInit(Timer* head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static bool listEmpty(const Timer* head)
+{
+	return head->next == head;
+}
+
+static void listAppend(Timer* head, Timer* timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void listRemove(Timer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = nullptr;
+	timer->prev = nullptr;
+}
+
+void wheelInit(TimerWheel* wheel, uint64_t tick_ms, uint64_t now_ms)
+{
+	wheel->tick_ms = tick_ms;
+	wheel->current = now_ms / tick_ms;
+	for (int level = 0; level < WHEEL_LEVELS; ++level) {
+		wheel->occupied[level] = 0;
+		for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+			listInit(&wheel->slots[level][slot]);
+		}
+	}
+	listInit(&wheel->expired);
+	wheel->count = 0;
+}
+
+void timerInit(Timer* timer, int owner)
+{
+	timer->next = nullptr;
+	timer->prev = nullptr;
+	timer->expires = 0;
+	timer->bucket = -1;
+	timer->owner = owner;
+}
+
+// Puts a timer in the lowest level on which it and the current tick differ
+// only in that level's digit, or on the expired list when it is due
+static void wheelPlace(TimerWheel* wheel, Timer* timer)
+{
+	if (timer->expires <= wheel->current) {
+		timer->bucket = -1;
+		listAppend(&wheel->expired, timer);
+		return;
+	}
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1
+		&& (timer->expires >> (WHEEL_BITS * (level + 1))) != (wheel->current >> (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	int slot = (int)(timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	timer->bucket = level * WHEEL_SLOTS + slot;
+	listAppend(&wheel->slots[level][slot], timer);
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+void timerSchedule(TimerWheel* wheel, Timer* timer, uint64_t expires_ms)
+{
+	if (timerPending(timer)) {
+		timerCancel(wheel, timer);
+	}
+	uint64_t expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	// Past the top level's range the slot would be ambiguous
+	uint64_t last = wheel->current + WHEEL_SPAN - 1;
+	timer->expires = expires < last ? expires : last;
+	wheelPlace(wheel, timer);
+	wheel->count++;
+}
+
+void timerCancel(TimerWheel* wheel, Timer* timer)
+{
+	if (!timerPending(timer)) {
+		return;
+	}
+	int bucket = timer->bucket;
+	listRemove(timer);
+	wheel->count--;
+	if (bucket >= 0) {
+		int level = bucket / WHEEL_SLOTS;
+		int slot = bucket % WHEEL_SLOTS;
+		if (listEmpty(&wheel->slots[level][slot])) {
+			wheel->occupied[level] &= ~((uint64_t)1 << slot);
+		}
+	}
+}
+
+// Moves every timer of one slot down to where it belongs now
+static void wheelCascade(TimerWheel* wheel, int level, int slot)
+{
+	Timer* head = &wheel->slots[level][slot];
+	wheel->occupied[level] &= ~((uint64_t)1 << slot);
+	while (!listEmpty(head)) {
+		Timer* timer = head->next;
+		listRemove(timer);
+		wheelPlace(wheel, timer);
+	}
+}
+
+// Handles one more tick: cascade the higher levels whose digit just rolled
+// over, then everything in the tick's level 0 slot is due
+static void wheelTick(TimerWheel* wheel)
+{
+	wheel->current++;
+	int top = 0;
+	while (top < WHEEL_LEVELS - 1 && (wheel->current & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+		top++;
+	}
+	for (int level = top; level > 0; --level) {
+		wheelCascade(wheel, level, (int)(wheel->current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+	}
+	wheelCascade(wheel, 0, (int)wheel->current & (WHEEL_SLOTS - 1));
+}
+
+// Next tick after current that has a level 0 slot to expire or a cascade to do
+static uint64_t wheelNextTick(const TimerWheel* wheel)
+{
+	int index = (int)(wheel->current & (WHEEL_SLOTS - 1));
+	uint64_t later = index == WHEEL_SLOTS - 1 ? 0 : wheel->occupied[0] & (~(uint64_t)0 << (index + 1));
+	if (later != 0) {
+		return (wheel->current & ~(uint64_t)(WHEEL_SLOTS - 1)) + __builtin_ctzll(later);
+	}
+	return (wheel->current | (WHEEL_SLOTS - 1)) + 1;
+}
+
+Timer* wheelExpired(TimerWheel* wheel, uint64_t now_ms)
+{
+	uint64_t target = now_ms / wheel->tick_ms;
+	while (listEmpty(&wheel->expired) && wheel->current < target) {
+		if (wheel->count == 0) {
+			wheel->current = target;
+			break;
+		}
+		// Skip straight over ticks with nothing to do
+		uint64_t next = wheelNextTick(wheel);
+		if (next > target) {
+			wheel->current = target;
+			break;
+		}
+		wheel->current = next - 1;
+		wheelTick(wheel);
+	}
+	if (listEmpty(&wheel->expired)) {
+		return nullptr;
+	}
+	Timer* timer = wheel->expired.next;
+	listRemove(timer);
+	wheel->count--;
+	return timer;
+}
+
+int wheelTimeout(const TimerWheel* wheel, uint64_t now_ms)
+{
+	if (!listEmpty(&wheel->expired)) {
+		return 0;
+	}
+	if (wheel->count == 0) {
+		return -1;
+	}
+	uint64_t due_ms = wheelNextTick(wheel) * wheel->tick_ms;
+	if (due_ms <= now_ms) {
+		return 0;
+	}
+	uint64_t wait = due_ms - now_ms;
+	return wait > 0x7fffffff ? 0x7fffffff : (int)wait;
+}
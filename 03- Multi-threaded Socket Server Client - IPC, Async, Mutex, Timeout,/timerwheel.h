@@ -0,0 +1,60 @@
+// timerwheel.h - hierarchical timer wheel
+//
+// Time is cut into ticks. Level 0 has a slot per tick for the next
+// WHEEL_SLOTS ticks, level 1 a slot per WHEEL_SLOTS ticks, and so on; a timer
+// sits in the lowest level whose range covers its expiry and moves down a
+// level when the wheel reaches its slot. Scheduling and cancelling are O(1)
+// list operations, and an occupancy bitmap per level lets the owner sleep
+// until the next tick that has work instead of waking every tick.
+//
+// Not thread safe: every reactor owns its wheel.
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4   // 64^4 ticks: about 19 days at 100 ms a tick
+
+// Embedded in whatever it times; owner tells the expiry handler whose it is
+struct Timer {
+	Timer*   next;       // NULL while not scheduled
+	Timer*   prev;
+	uint64_t expires;    // Tick
+	int      bucket;     // level * WHEEL_SLOTS + slot, -1 on the expired list
+	int      owner;
+};
+
+struct TimerWheel {
+	uint64_t tick_ms;
+	uint64_t current;                        // Last tick handled
+	uint64_t occupied[WHEEL_LEVELS];         // Bit per non-empty slot
+	Timer    slots[WHEEL_LEVELS][WHEEL_SLOTS];   // List heads
+	Timer    expired;                        // Due, not yet handed out
+	uint32_t count;                          // Scheduled timers, expired ones included
+};
+
+void wheelInit(TimerWheel* wheel, uint64_t tick_ms, uint64_t now_ms);
+
+void timerInit(Timer* timer, int owner);
+
+inline bool timerPending(const Timer* timer) {
+	return timer->next != nullptr;
+}
+
+// (Re)schedules timer to expire at expires_ms, rounded up to the next tick so
+// it never fires early. Expiries beyond the wheel's span are clamped to its
+// end; the handler is expected to check its own deadline.
+void timerSchedule(TimerWheel* wheel, Timer* timer, uint64_t expires_ms);
+void timerCancel(TimerWheel* wheel, Timer* timer);
+
+// Advances the wheel to now_ms and returns the next expired timer, no longer
+// scheduled, or NULL when nothing else is due. Call until it returns NULL.
+Timer* wheelExpired(TimerWheel* wheel, uint64_t now_ms);
+
+// Milliseconds until the wheel next has work, 0 when timers are already due,
+// -1 when nothing is scheduled. Suitable as an epoll_wait() timeout.
+int wheelTimeout(const TimerWheel* wheel, uint64_t now_ms);
+
+#endif//TIMERWHEEL_H
@@ -0,0 +1,582 @@
+// uring.cpp - io_uring backend for the TCP message server
+//
+// Same connection table, framing and output queue as the epoll backend, but
+// the kernel does the accepting and receiving:
+//   - one multishot accept produces a completion per new client
+//   - one multishot recv per client produces a completion per chunk of data,
+//     written into a buffer the kernel picks from a provided buffer ring
+//   - every re-arm queued while handling completions is submitted in the same
+//     io_uring_enter() call that waits for the next batch
+// The raw system calls are used so the server has no dependency on liburing.
+
+#include <iostream>         // For cout, cerr
+#include <linux/io_uring.h> // For io_uring structures and constants
+#include <poll.h>           // For POLLOUT
+#include <sys/mman.h>       // For mmap(), munmap()
+#include <sys/socket.h>     // For shutdown()
+#include <sys/syscall.h>    // For __NR_io_uring_*
+#include <unistd.h>         // For syscall(), close()
+#include <cstring>          // For memset(), strerror()
+#include <errno.h>          // For errno
+#include "server.h"
+
+using namespace std;
+
+#define URING_ENTRIES 1024        // Submission queue size
+#define URING_BUFFER_COUNT 1024   // Provided receive buffers, power of two
+#define URING_BUFFER_SIZE 4096    // Size of each receive buffer
+#define URING_BUFFER_GROUP 0
+
+// user_data layout: operation in the top byte, connection generation in the
+// next 24 bits, connection slot in the low 32 bits
+enum UringOp {
+	OP_ACCEPT = 1,
+	OP_RECV   = 2,
+	OP_CANCEL = 3,
+	OP_POLLOUT = 4
+};
+
+struct Uring {
+	int ring_fd;
+
+	// Submission queue, shared with the kernel
+	void*                sq_ptr;
+	size_t               sq_size;
+	unsigned*            sq_head;
+	unsigned*            sq_tail;
+	unsigned*            sq_mask;
+	unsigned*            sq_array;
+	unsigned             sq_entries;
+	struct io_uring_sqe* sqes;
+	size_t               sqes_size;
+
+	// Completion queue, shared with the kernel
+	void*                cq_ptr;
+	size_t               cq_size;
+	unsigned*            cq_head;
+	unsigned*            cq_tail;
+	unsigned*            cq_mask;
+	struct io_uring_cqe* cqes;
+
+	// Provided buffer ring the kernel picks receive buffers from
+	struct io_uring_buf_ring* buf_ring;
+	size_t                    buf_ring_size;
+	char*                     buffers;
+	unsigned                  buf_tail;
+
+	bool stopping;   // Loop has ended: completions only release resources
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uringRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static uint64_t uringTag(int op, Reactor* reactor, int slot)
+{
+	uint64_t generation = slot < 0 ? 0 : reactor->connections[slot].generation & 0xFFFFFF;
+	return ((uint64_t)op << 56) | (generation << 32) | (uint32_t)slot;
+}
+
+// Hand a receive buffer (back) to the kernel
+static void uringProvideBuffer(Uring* ring, unsigned bid)
+{
+	// The ring is a plain array of io_uring_buf; the tail overlays the reserved
+	// field of entry 0. Index it directly: in C++ the header's flexible array
+	// member is not placed at offset 0.
+	struct io_uring_buf* buf = (struct io_uring_buf*)ring->buf_ring + (ring->buf_tail & (URING_BUFFER_COUNT - 1));
+	buf->addr = (uint64_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, (uint16_t)ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uringFree(Uring* ring)
+{
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	delete[] ring->buffers;
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	if (ring->sq_ptr != NULL) {
+		munmap(ring->sq_ptr, ring->sq_size);
+	}
+	if (ring->ring_fd >= 0) {
+		close(ring->ring_fd);
+	}
+}
+
+static int uringInit(Uring* ring)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	// Only this thread submits, and completions are only needed when we ask
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	ring->ring_fd = uringSetup(URING_ENTRIES, &params);
+	if (ring->ring_fd < 0 && errno == EINVAL) {
+		// Older kernel without the optional flags
+		memset(&params, 0, sizeof(params));
+		ring->ring_fd = uringSetup(URING_ENTRIES, &params);
+	}
+	if (ring->ring_fd < 0) {
+		cerr << "io_uring_setup failed: " << strerror(errno) << endl;
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG)) {
+		cerr << "io_uring: kernel lacks IORING_FEAT_EXT_ARG" << endl;
+		uringFree(ring);
+		return -1;
+	}
+
+	// Map the submission and completion rings (one mapping on recent kernels)
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		cerr << "io_uring: mapping the submission ring failed: " << strerror(errno) << endl;
+		uringFree(ring);
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			cerr << "io_uring: mapping the completion ring failed: " << strerror(errno) << endl;
+			uringFree(ring);
+			return -1;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		cerr << "io_uring: mapping the submission entries failed: " << strerror(errno) << endl;
+		uringFree(ring);
+		return -1;
+	}
+
+	char* sq = (char*)ring->sq_ptr;
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	char* cq = (char*)ring->cq_ptr;
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// Register the provided buffer ring and fill it with every buffer
+	ring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	void* buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf_ring == MAP_FAILED) {
+		cerr << "io_uring: allocating the buffer ring failed: " << strerror(errno) << endl;
+		uringFree(ring);
+		return -1;
+	}
+	ring->buf_ring = (struct io_uring_buf_ring*)buf_ring;
+	ring->buffers = new char[(size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE];
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)ring->buf_ring;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (uringRegister(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		cerr << "io_uring: registering the buffer ring failed: " << strerror(errno) << endl;
+		uringFree(ring);
+		return -1;
+	}
+	for (unsigned bid = 0; bid < URING_BUFFER_COUNT; ++bid) {
+		uringProvideBuffer(ring, bid);
+	}
+	return 0;
+}
+
+static int uringSubmitAndWait(Reactor* reactor, Uring* ring, int timeout_ms);
+
+// Next free submission entry. Queued entries are only handed to the kernel by
+// the next io_uring_enter(), which is what batches the submissions.
+static struct io_uring_sqe* uringGetSqe(Reactor* reactor, Uring* ring)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries) {
+		// Submission queue full, push what we have without waiting
+		uringSubmitAndWait(reactor, ring, 0);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Submit everything queued and wait up to timeout_ms for at least one completion.
+static int uringSubmitAndWait(Reactor* reactor, Uring* ring, int timeout_ms)
+{
+	unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)&ts;
+
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	unsigned min_complete = 0;
+	if (timeout_ms > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		min_complete = 1;
+	}
+	int rc = uringEnter(ring->ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+	statAdd(reactor->stats.syscalls, 1);
+	if (rc < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) {
+		return 0;
+	}
+	return rc;
+}
+
+static void uringArmAccept(Uring* ring, Reactor* reactor)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = reactor->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = uringTag(OP_ACCEPT, reactor, -1);
+}
+
+static void uringArmRecv(Uring* ring, Reactor* reactor, int slot)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		cerr << "io_uring: submission queue full, closing client" << endl;
+		connectionClose(reactor, slot);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = reactor->connections[slot].fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = uringTag(OP_RECV, reactor, slot);
+	reactor->connections[slot].recv_armed = true;
+}
+
+// Stop a throttled client's recv. Its final completion arrives with -ECANCELED.
+static void uringCancelRecv(Uring* ring, Reactor* reactor, int slot)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		// The budget is exceeded a little further until the next attempt
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = uringTag(OP_RECV, reactor, slot);
+	sqe->user_data = uringTag(OP_CANCEL, reactor, slot);
+}
+
+// Wait until a client's socket has room for the echoes it refused
+static void uringArmPollOut(Uring* ring, Reactor* reactor, int slot)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		cerr << "io_uring: submission queue full, dropping client" << endl;
+		reactor->connections[slot].closing = true;
+		shutdown(reactor->connections[slot].fd, SHUT_RDWR);
+		return;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = reactor->connections[slot].fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = uringTag(OP_POLLOUT, reactor, slot);
+}
+
+static void uringHandleAccept(Uring* ring, Reactor* reactor, struct io_uring_cqe* cqe)
+{
+	if (cqe->res >= 0) {
+		int slot = connectionOpen(reactor, cqe->res);
+		if (slot >= 0) {
+			uringArmRecv(ring, reactor, slot);
+		}
+	}
+	else if (cqe->res != -EAGAIN && cqe->res != -ECANCELED && cqe->res != -ECONNABORTED) {
+		cerr << "Accepting connection failed: " << strerror(-cqe->res) << endl;
+	}
+
+	// The kernel ended the multishot request (error or overflow), start another
+	// one, unless it was cancelled for shutdown
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !reactor->draining) {
+		uringArmAccept(ring, reactor);
+	}
+}
+
+static void uringHandleRecv(Uring* ring, Reactor* reactor, struct io_uring_cqe* cqe)
+{
+	uint64_t tag = cqe->user_data;
+	int slot = (int)(uint32_t)tag;
+	Connection* conn = &reactor->connections[slot];
+	bool current = conn->fd >= 0 && (conn->generation & 0xFFFFFF) == ((tag >> 32) & 0xFFFFFF);
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (current && !conn->closing && cqe->res > 0) {
+			bool blocked = conn->write_blocked;
+			bool throttled = conn->throttled;
+			if (connectionData(reactor, slot, ring->buffers + (size_t)bid * URING_BUFFER_SIZE, cqe->res) < 0) {
+				// Stop the multishot recv; the connection is closed on its final completion
+				conn->closing = true;
+				shutdown(conn->fd, SHUT_RDWR);
+			}
+			else {
+				if (!blocked && conn->write_blocked) {
+					uringArmPollOut(ring, reactor, slot);
+				}
+				// Over budget: stop receiving so the data backs up in the socket.
+				// Completions already on their way are still handled.
+				if (!throttled && connectionThrottle(reactor, slot) && (cqe->flags & IORING_CQE_F_MORE)) {
+					uringCancelRecv(ring, reactor, slot);
+				}
+			}
+		}
+		// The data has been copied into the frame parser, recycle the buffer
+		uringProvideBuffer(ring, bid);
+	}
+
+	if (!current || (cqe->flags & IORING_CQE_F_MORE)) {
+		return;
+	}
+	conn->recv_armed = false;
+
+	// Shutting down: leave the socket open for reactorClose()
+	if (ring->stopping) {
+		return;
+	}
+
+	// Final completion of this recv request
+	if (!conn->closing && (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)) {
+		// Ran out of provided buffers, the kernel stopped early or the client was
+		// throttled: re-arm, unless it is still throttled (then it is re-armed on resume)
+		if (!conn->throttled) {
+			uringArmRecv(ring, reactor, slot);
+		}
+		return;
+	}
+	if (cqe->res < 0 && cqe->res != -ECONNRESET && cqe->res != -ECANCELED) {
+		cerr << "Read error: " << strerror(-cqe->res) << endl;
+	}
+	// Client closed the connection, or an error ended it
+	connectionClose(reactor, slot);
+}
+
+static void uringHandlePollOut(Uring* ring, Reactor* reactor, struct io_uring_cqe* cqe)
+{
+	uint64_t tag = cqe->user_data;
+	int slot = (int)(uint32_t)tag;
+	Connection* conn = &reactor->connections[slot];
+	if (cqe->res < 0 || conn->fd < 0 || (conn->generation & 0xFFFFFF) != ((tag >> 32) & 0xFFFFFF)
+		|| conn->closing) {
+		return;
+	}
+
+	int rc = connectionFlush(reactor, slot);
+	if (rc < 0) {
+		// Ends the recv request too, whose final completion closes the slot
+		conn->closing = true;
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	else if (rc > 0 && !ring->stopping) {
+		uringArmPollOut(ring, reactor, slot);
+	}
+}
+
+static void uringHandleCompletions(Uring* ring, Reactor* reactor, int* cancelled, int* finished)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+		switch (cqe->user_data >> 56) {
+		case OP_ACCEPT:
+			uringHandleAccept(ring, reactor, cqe);
+			break;
+		case OP_RECV:
+			uringHandleRecv(ring, reactor, cqe);
+			break;
+		case OP_POLLOUT:
+			uringHandlePollOut(ring, reactor, cqe);
+			break;
+		case OP_CANCEL:
+			// Only the shutdown cancel (no slot) reports back, throttling cancels are fire and forget
+			if (cancelled != NULL && (uint32_t)cqe->user_data == UINT32_MAX) {
+				*cancelled = cqe->res;
+			}
+			break;
+		}
+		if (finished != NULL && (cqe->user_data >> 56) != OP_CANCEL && !(cqe->flags & IORING_CQE_F_MORE)) {
+			(*finished)++;
+		}
+		head++;
+		// Release each entry as soon as it is handled so the kernel can reuse it
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		if (head == tail) {
+			tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+}
+
+// Drop a connection whose socket failed or timed out
+static void uringDropConnection(Reactor* reactor, int slot)
+{
+	Connection* conn = &reactor->connections[slot];
+	if (!conn->recv_armed) {
+		// Throttled, no recv left to complete
+		connectionClose(reactor, slot);
+		return;
+	}
+	// Ends the recv request, whose final completion closes the slot
+	conn->closing = true;
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+// Stop the multishot accept when shutting down; its final completion is
+// not re-armed
+static void uringCancelAccept(Uring* ring, Reactor* reactor)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = uringTag(OP_ACCEPT, reactor, -1);
+	sqe->user_data = uringTag(OP_CANCEL, reactor, 0);
+}
+
+// Cancel the outstanding accept and recv requests and wait for their final
+// completions, so the kernel no longer writes into our receive buffers when
+// they are released.
+static void uringCancelAll(Uring* ring, Reactor* reactor)
+{
+	struct io_uring_sqe* sqe = uringGetSqe(reactor, ring);
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = uringTag(OP_CANCEL, reactor, -1);
+	ring->stopping = true;
+
+	int cancelled = -1;
+	int finished = 0;
+	uint64_t deadline = nowNs() + 1000000000ull;
+	while ((cancelled < 0 || finished < cancelled) && nowNs() < deadline) {
+		if (uringSubmitAndWait(reactor, ring, 100) < 0) {
+			break;
+		}
+		uringHandleCompletions(ring, reactor, &cancelled, &finished);
+	}
+}
+
+void* uringReactorThread(void* arg)
+{
+	Reactor* reactor = (Reactor*)arg;
+	reactorPin(reactor);
+
+	Uring ring;
+	if (uringInit(&ring) < 0) {
+		cerr << "Reactor " << reactor->id << ": io_uring backend unavailable" << endl;
+		is_running = false;
+		pthread_exit(NULL);
+	}
+
+	uringArmAccept(&ring, reactor);
+
+	while (!reactorFinished(reactor)) {
+		reactorReport(reactor);
+
+		// One system call submits every re-arm from the last batch and waits
+		// (at most a second, to check is_running) for new completions
+		if (uringSubmitAndWait(reactor, &ring, reactorTimeout(reactor)) < 0) {
+			cerr << "io_uring_enter failed: " << strerror(errno) << endl;
+			break;
+		}
+
+		uringHandleCompletions(&ring, reactor, NULL, NULL);
+
+		// Start receiving again for clients back under budget
+		int slot;
+		while ((slot = connectionResumable(reactor)) >= 0) {
+			if (!reactor->connections[slot].recv_armed) {
+				uringArmRecv(&ring, reactor, slot);
+			}
+		}
+
+		while ((slot = connectionExpired(reactor)) >= 0) {
+			uringDropConnection(reactor, slot);
+		}
+
+		if (!is_running && !reactor->draining) {
+			uringCancelAccept(&ring, reactor);
+			reactorDrain(reactor);
+		}
+
+		// Responses produced by this batch of completions, one send() per client
+		while ((slot = connectionDirty(reactor)) >= 0) {
+			int rc = connectionFlush(reactor, slot);
+			if (rc < 0) {
+				uringDropConnection(reactor, slot);
+			}
+			else if (rc > 0) {
+				uringArmPollOut(&ring, reactor, slot);
+			}
+		}
+	}
+
+	// The sockets themselves are closed by reactorClose()
+	uringCancelAll(&ring, reactor);
+	uringFree(&ring);
+	poolFlushCache();
+	pthread_exit(NULL);
+}
@@ -0,0 +1,11 @@
+# Usage: ./bench_transports.sh [mqbench options]
+# Runs mqbench against a fresh server on each transport, e.g. ./bench_transports.sh -p 2 -s 1024 -R 50000
+# SERVER_ARGS goes to the server, e.g. SERVER_ARGS="-d relay.wal" for the durable mode.
+for transport in sysv posix; do
+    ./server -q -t $transport $SERVER_ARGS > /dev/null &
+    server=$!
+    sleep 0.5
+    ./mqbench -t $transport -P $server "$@"
+    kill -2 $server
+    wait $server
+done
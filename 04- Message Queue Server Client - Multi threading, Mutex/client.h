@@ -5,12 +5,41 @@
 #ifndef CLIENT1_H
 #define CLIENT1_H
 
-const int BUF_LEN = 64;
+#include <stddef.h>
+
+// Payload capacity of one message. The kernel's msgmax (8192 by default)
+// usually limits it further; longer payloads are split into chunks.
+const int BUF_LEN = 65536;
+
+// System V message types. A client receives on its id, assigned from 1
+// upwards at registration. The server's inbox and the replies to registering
+// clients (REPLY_MTYPE_BASE + token, usually the pid) lie above any client id.
+const long SERVER_MTYPE = 1L << 40;
+const long REPLY_MTYPE_BASE = 1L << 41;
+
+// Destinations besides client ids
+const long DEST_SERVER = 0;       // Control messages for the server itself
+const long DEST_BROADCAST = -1;   // Every registered client but the sender
+const long DEST_FANOUT = -2;      // The clients listed in front of the payload, see msgSendFanout()
+
+// flags
+const unsigned int CHUNK_MORE = 0x1;       // Further chunks of the same payload follow
+const unsigned int MSG_REGISTER = 0x2;     // To the server, source is the reply token, payload the pid
+const unsigned int MSG_WELCOME = 0x4;      // Reply to MSG_REGISTER: dest is the new id, payload the ids already registered
+const unsigned int MSG_UNREGISTER = 0x8;   // To the server; answered with "Quit" so the receive thread leaves
+const unsigned int MSG_UNKNOWN = 0x10;     // Bounced to a sender: client source is not registered
+const unsigned int MSG_URGENT = 0x20;      // POSIX transport: delivered ahead of ordinary messages
+const unsigned int MSG_BATCH = 0x40;       // Payload is several messages, see msgBatchAdd()
+const unsigned int MSG_ACK = 0x80;         // From a durable server (-d): payload is a long, how many more of the
+                                           // receiver's payloads are logged
 
 // structure for message queue 
+// Only the header and the len bytes used of buf are passed to msgsnd()
 typedef struct mesg_buffer {
-    long source;
-    long dest;
+    long source;         // Client id, 0 for the server
+    long dest;           // Client id or one of the DEST_ values
+    unsigned int len;    // Payload bytes in buf
+    unsigned int flags;  // CHUNK_MORE and the MSG_ control bits
     char buf[BUF_LEN];
 } MesgBuffer;
 
@@ -19,4 +48,7 @@ typedef struct mymsg {
     MesgBuffer msgBuf;
 } Message;
 
-#endif//CLIENT1_H
\ No newline at end of file
+// Bytes of MesgBuffer in front of the payload
+const size_t MSG_HEADER_SIZE = offsetof(MesgBuffer, buf);
+
+#endif//CLIENT1_H
@@ -1,26 +1,26 @@
-// client2.cpp - C Program for Message Queue (Read/Write) 
+// client2.cpp - C Program for Message Queue (Read/Write)
 //
 // 27-Mar-20  M. Watler         Created.
 //
-#include <errno.h> 
-#include <iostream> 
-#include <queue> 
-#include <signal.h> 
+#include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <queue>
+#include <signal.h>
 #include <string.h>
-#include <sys/ipc.h> 
-#include <sys/msg.h> 
 #include <unistd.h>
 #include "client.h"
+#include "mqclient.h"
 
 using namespace std;
 
-key_t key2;
-int msgid2;
+Transport transport2=TRANSPORT_SYSV;
+MqClient client2;//registration, send and receive threads
 
 bool is_running;
-queue<Message> message2;
-
-void *recv_func2(void *arg);
+queue<pair<long, string> > message2;   // Source and complete payload
+queue<long> gone2;                     // Clients the server says are not registered
 
 /* shared mutex between receive thread and send */
 pthread_mutex_t lock_x;
@@ -33,12 +33,30 @@ static void shutdownHandler(int sig)
             break;
     }
 }
-  
-int main() 
-{ 
-    int ret;
-    pthread_t tid2;
-  
+
+//Called on the client's receive thread
+static void onMessage2(long source, const char* data, size_t len, void* arg)
+{
+    pthread_mutex_lock(&lock_x);
+    message2.push(make_pair(source, string(data, len)));
+    pthread_mutex_unlock(&lock_x);
+}
+
+static void onGone2(long id, void* arg)
+{
+    pthread_mutex_lock(&lock_x);
+    gone2.push(id);
+    pthread_mutex_unlock(&lock_x);
+}
+
+//The server said Quit
+static void onQuit2(void* arg)
+{
+    is_running=false;
+}
+
+int main(int argc, char* argv[])
+{
     //Intercept ctrl-C
     struct sigaction action;
 
@@ -47,61 +65,59 @@ int main()
     action.sa_flags = 0;
     sigaction(SIGINT, &action, NULL);
 
-    // ftok to generate unique key 
-    key2 = ftok("serverclient", 65); 
-
-    // msgget creates a message queue 
-    // and returns identifier 
-    msgid2 = msgget(key2, 0666 | IPC_CREAT); 
+    //-t sysv|posix, as given to the server
+    int opt;
+    while((opt=getopt(argc, argv, "t:"))!=-1) {
+        if(opt!='t' || msgTransport(optarg, &transport2)==-1) {
+            cout<<"usage: "<<argv[0]<<" [-t sysv|posix]"<<endl;
+            return -1;
+        }
+    }
 
     pthread_mutex_init(&lock_x, NULL);
     is_running=true;
-    ret = pthread_create(&tid2, NULL, recv_func2, NULL);
-    if(ret!=0) {
-        is_running = false;
-        cout<<strerror(errno)<<endl;
+
+    // The server assigns our id and tells us who is already there
+    MqClientOptions options;
+    mqClientDefaults(&options, transport2);
+    options.on_receive=onMessage2;
+    options.on_gone=onGone2;
+    options.on_quit=onQuit2;
+    if(mqClientOpen(&client2, &options)==-1) {
+        cout<<"client2: cannot register: "<<strerror(errno)<<endl;
         return -1;
     }
+    vector<long> peers=client2.peers;
+    cout<<"client2: registered as client "<<client2.id<<", "<<peers.size()<<" other client(s)"<<endl;
 
-    int dest=0;
+    size_t next=0;
     while(is_running) {
-        while(message2.size()>0) {
-	    pthread_mutex_lock(&lock_x);
-            Message recvMsg=message2.front();
-	    message2.pop();
-	    pthread_mutex_unlock(&lock_x);
-	    cout<<"client 2: from client "<<recvMsg.msgBuf.source<<" "<<recvMsg.msgBuf.buf<<endl;
-	}
-	//Alternate between client 1 and client 3
-	if(dest==3) dest=1;
-	else        dest=3;
-	Message sendMsg;
-        sendMsg.mtype=4;// Send the message to the server for dispatch
-	sendMsg.msgBuf.source = 2;
-	sendMsg.msgBuf.dest = dest;
-        sprintf(sendMsg.msgBuf.buf, "%d: Message from client 2\n", getpid());
-	msgsnd(msgid2, &sendMsg, sizeof(sendMsg), 0);
+        pthread_mutex_lock(&lock_x);
+        while(!message2.empty()) {
+            pair<long, string> recvMsg=message2.front();
+            message2.pop();
+            cout<<"client "<<client2.id<<": from client "<<recvMsg.first<<" "<<msgPreview(recvMsg.second.data(), recvMsg.second.size())<<endl;
+            //Senders we did not know about become destinations too
+            if(find(peers.begin(), peers.end(), recvMsg.first)==peers.end()) peers.push_back(recvMsg.first);
+        }
+        while(!gone2.empty()) {
+            peers.erase(remove(peers.begin(), peers.end(), gone2.front()), peers.end());
+            gone2.pop();
+        }
+        pthread_mutex_unlock(&lock_x);
+
+        char text[64];
+        int len=sprintf(text, "%d: Message from client %ld\n", getpid(), client2.id);
+        //Take turns between the known clients, or greet everybody while we know nobody
+        long dest=DEST_BROADCAST;
+        if(!peers.empty()) dest=peers[next++%peers.size()];
+        // Queue the message for the server to dispatch; the client's sender thread sends it
+        mqClientSend(&client2, dest, text, len);
         sleep(1);
     }
     cout<<"client2: quitting..."<<endl;
-    pthread_join(tid2, NULL);
-    msgctl(msgid2, IPC_RMID, NULL); 
-
-    return 0; 
-} 
+    //Sends what is queued, unregisters and drops what is left for us
+    mqClientClose(&client2);
 
-void *recv_func2(void *arg)
-{
-    while(is_running) {
-        // msgrcv to receive message 
-        Message msg;
-        msgrcv(msgid2, &msg, sizeof(msg), 2, 0);//extract messages of mtype 2 for client 2
-	if(strncmp(msg.msgBuf.buf, "Quit", 4)==0) is_running=false;
-	else {
-	    pthread_mutex_lock(&lock_x);
-            message2.push(msg);
-	    pthread_mutex_unlock(&lock_x);
-	}
-    }
-    pthread_exit(NULL);
+    return 0;
 }
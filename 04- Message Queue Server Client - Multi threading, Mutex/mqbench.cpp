@@ -0,0 +1,339 @@
+// mqbench.cpp - Relay throughput and latency over either transport
+//
+// Starts pairs of mqclient clients in one process, each registered with a
+// running server: the sender of a pair queues its messages for the receiver as
+// fast as its client takes them, or at a fixed rate, and the receiver notes
+// how long each one took. Every message carries its send time in the first 8
+// payload bytes; at a fixed rate that is the time it was due (open loop), so a
+// stalled relay shows up as latency instead of as a sender that waited.
+// Given the server's pid, the server's CPU time per message is reported too.
+//
+// usage: mqbench [-t sysv|posix] [-p pairs] [-n messages] [-s size] [-R rate] [-b delay_us]
+//                [-r threads] [-P server_pid] [-a] [-u]
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include "client.h"
+#include "mqclient.h"
+
+using namespace std;
+
+struct Pair {
+	MqClient         sender;
+	MqClient         receiver;
+	pthread_t        send_tid;
+	uint64_t         start_ns;      // Due time of the first message
+	uint64_t         interval_ns;   // Between two messages, 0 for as fast as possible
+	long             received;      // Under lock_received
+	uint64_t         last_ns;       // Arrival of the latest message, under lock_received
+	atomic<long>     acked;         // -a: sends the server confirmed
+	vector<uint64_t> latency;       // Nanoseconds, receiver's callback thread only
+};
+
+#define STALL_SECONDS 5   // Give up once nothing arrived for this long
+
+Transport transport = TRANSPORT_SYSV;
+long count_per_sender = 10000;
+size_t msg_size = 64;
+unsigned int flags;   // MSG_URGENT with -u
+long batch_us = -1;   // -b: senders batch, a message waits at most this long
+int receive_threads = 1;
+bool durable;         // -a: wait for a durable server's acknowledgements
+double rate;          // -R: messages per second over all senders, 0 for as fast as possible
+pid_t server_pid;     // -P: report the server's CPU time per message
+
+pthread_mutex_t lock_received;
+pthread_cond_t all_received;   // A receiver has all its messages
+
+static uint64_t monotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+// User plus system time of a process so far, in clock ticks
+static bool cpuTicks(pid_t pid, uint64_t* ticks)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		return false;
+	}
+	char line[1024];
+	bool found = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+	// The command name may hold spaces; the fields after it are fixed
+	const char* fields = found ? strrchr(line, ')') : NULL;
+	unsigned long utime;
+	unsigned long stime;
+	if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return false;
+	}
+	*ticks = utime + stime;
+	return true;
+}
+
+static void usage(const char* name)
+{
+	cout << "usage: " << name << " [-t sysv|posix] [-p pairs] [-n messages] [-s size] [-R rate] [-b delay_us]" << endl;
+	cout << "               [-r threads] [-P server_pid] [-a] [-u]" << endl;
+	cout << "  -t transport  the one the server was started with (default sysv)" << endl;
+	cout << "  -p pairs      sender and receiver pairs (default 1)" << endl;
+	cout << "  -n messages   per sender (default 10000)" << endl;
+	cout << "  -s size       payload bytes, at least 8 (default 64)" << endl;
+	cout << "  -R rate       messages per second over all senders (default: as fast as possible)" << endl;
+	cout << "  -b delay_us   senders pack messages into batches sent when full or delay_us old" << endl;
+	cout << "  -r threads    receive callback threads per client (default 1)" << endl;
+	cout << "  -P server_pid report the server's CPU time per message" << endl;
+	cout << "  -a            count the acknowledgements of a durable server (-d)" << endl;
+	cout << "  -u            send everything urgent (POSIX priority)" << endl;
+}
+
+static void onMessage(long source, const char* data, size_t len, void* arg)
+{
+	Pair* pair = (Pair*)arg;
+	// A payload that lost chunks to a dropping server (-p drop) comes out short or long
+	if (source != pair->sender.id || len != msg_size) {
+		return;
+	}
+	uint64_t sent;
+	memcpy(&sent, data, sizeof(sent));
+	uint64_t now = monotonicNs();
+	pair->latency.push_back(now > sent ? now - sent : 0);
+	pthread_mutex_lock(&lock_received);
+	pair->last_ns = now;
+	if (++pair->received == count_per_sender) {
+		pthread_cond_signal(&all_received);
+	}
+	pthread_mutex_unlock(&lock_received);
+}
+
+static int benchOpen(Pair* pair, MqClient* client, long token)
+{
+	MqClientOptions options;
+	mqClientDefaults(&options, transport);
+	options.token = token;
+	options.batch_us = batch_us;
+	options.receive_threads = receive_threads;
+	options.durable = durable;
+	options.on_receive = onMessage;
+	options.arg = pair;
+	return mqClientOpen(client, &options);
+}
+
+static void onAcked(int error, void* arg)
+{
+	if (error == 0) {
+		((Pair*)arg)->acked++;
+	}
+}
+
+static void* sendThread(void* arg)
+{
+	Pair* pair = (Pair*)arg;
+	char* payload = (char*)calloc(1, msg_size);
+	// All senders start together, once every thread is up
+	sleepUntil(pair->start_ns);
+	for (long i = 0; i < count_per_sender; ++i) {
+		uint64_t stamp = monotonicNs();
+		if (pair->interval_ns > 0) {
+			uint64_t due = pair->start_ns + i * pair->interval_ns;
+			if (stamp < due) {
+				sleepUntil(due);
+			}
+			stamp = due;
+		}
+		memcpy(payload, &stamp, sizeof(stamp));
+		if (mqClientSend(&pair->sender, pair->receiver.id, payload, msg_size, flags, durable ? onAcked : NULL, pair) == -1) {
+			cout << "mqbench: send error: " << strerror(errno) << endl;
+			break;
+		}
+	}
+	free(payload);
+	pthread_exit(NULL);
+}
+
+int main(int argc, char* argv[])
+{
+	int pairs = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:p:n:s:R:b:r:P:au")) != -1) {
+		switch (opt) {
+		case 't':
+			if (msgTransport(optarg, &transport) == -1) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 'n':
+			count_per_sender = atol(optarg);
+			break;
+		case 's':
+			msg_size = atol(optarg);
+			break;
+		case 'R':
+			rate = atof(optarg);
+			break;
+		case 'b':
+			batch_us = atol(optarg);
+			break;
+		case 'P':
+			server_pid = atoi(optarg);
+			break;
+		case 'r':
+			receive_threads = atoi(optarg);
+			break;
+		case 'a':
+			durable = true;
+			break;
+		case 'u':
+			flags = MSG_URGENT;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (pairs < 1 || count_per_sender < 1 || msg_size < sizeof(uint64_t) || msg_size > BUF_LEN || rate < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	// Tokens must differ between the clients of this process
+	pthread_mutex_init(&lock_received, NULL);
+	pthread_cond_init(&all_received, NULL);
+	vector<Pair> pair(pairs);
+	long token = (long)getpid() << 16;
+	for (int i = 0; i < pairs; ++i) {
+		pair[i].received = 0;
+		pair[i].last_ns = 0;
+		pair[i].acked = 0;
+		pair[i].latency.reserve(count_per_sender);
+		if (benchOpen(&pair[i], &pair[i].receiver, token++) == -1 || benchOpen(&pair[i], &pair[i].sender, token++) == -1) {
+			cout << "mqbench: cannot register: " << strerror(errno) << endl;
+			return -1;
+		}
+	}
+
+	// Senders share the rate; their schedules are staggered so the messages do
+	// not all fall due at the same instant
+	uint64_t interval = rate > 0 ? (uint64_t)(1e9 * pairs / rate) : 0;
+	uint64_t start = monotonicNs() + 10000000ull;
+	uint64_t ticks_before = 0;
+	bool cpu = server_pid > 0 && cpuTicks(server_pid, &ticks_before);
+	if (server_pid > 0 && !cpu) {
+		cout << "mqbench: cannot read the CPU time of pid " << server_pid << endl;
+	}
+	for (int i = 0; i < pairs; ++i) {
+		pair[i].interval_ns = interval;
+		pair[i].start_ns = start + (interval > 0 ? interval * i / pairs : 0);
+		pthread_create(&pair[i].send_tid, NULL, sendThread, &pair[i]);
+	}
+	for (int i = 0; i < pairs; ++i) {
+		pthread_join(pair[i].send_tid, NULL);
+	}
+
+	// A relay dropping messages (server -p drop) must not keep us waiting forever
+	long received = 0;
+	long last = -1;
+	uint64_t stalled = monotonicNs();
+	pthread_mutex_lock(&lock_received);
+	while (true) {
+		received = 0;
+		for (int i = 0; i < pairs; ++i) {
+			received += pair[i].received;
+		}
+		if (received == count_per_sender * pairs) {
+			break;
+		}
+		if (received != last) {
+			last = received;
+			stalled = monotonicNs();
+		}
+		else if (monotonicNs() - stalled > STALL_SECONDS * 1000000000ull) {
+			break;
+		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_cond_timedwait(&all_received, &lock_received, &deadline);
+	}
+	uint64_t last_arrival = start;
+	for (int i = 0; i < pairs; ++i) {
+		last_arrival = max(last_arrival, pair[i].last_ns);
+	}
+	pthread_mutex_unlock(&lock_received);
+	// Up to the last arrival, not the wait for messages that never came
+	double seconds = (last_arrival - start) / 1e9;
+	uint64_t ticks_after = 0;
+	cpu = cpu && cpuTicks(server_pid, &ticks_after);
+
+	for (int i = 0; i < pairs; ++i) {
+		mqClientClose(&pair[i].sender);
+		mqClientClose(&pair[i].receiver);
+	}
+	vector<uint64_t> latency;
+	long acked = 0;
+	for (int i = 0; i < pairs; ++i) {
+		latency.insert(latency.end(), pair[i].latency.begin(), pair[i].latency.end());
+		acked += pair[i].acked;
+	}
+
+	cout << "mqbench: " << (transport == TRANSPORT_POSIX ? "posix" : "sysv") << ", " << pairs << " pair(s), "
+		<< received << " messages of " << msg_size << " bytes in " << seconds << " s: "
+		<< (long)(received / seconds) << " messages/s";
+	if (received < count_per_sender * pairs) {
+		cout << ", " << count_per_sender * pairs - received << " missing";
+	}
+	if (durable) {
+		cout << ", " << acked << " acknowledged";
+	}
+	cout << endl;
+	if (rate > 0 && received / seconds < rate * 0.95) {
+		cout << "mqbench: could not keep up with " << rate << " messages/s" << endl;
+	}
+	if (!latency.empty()) {
+		sort(latency.begin(), latency.end());
+		uint64_t sum = 0;
+		for (size_t i = 0; i < latency.size(); ++i) {
+			sum += latency[i];
+		}
+		cout << "latency (us): min " << latency.front() / 1000.0
+			<< "  avg " << (double)sum / latency.size() / 1000.0
+			<< "  p50 " << latency[latency.size() / 2] / 1000.0
+			<< "  p90 " << latency[latency.size() * 90 / 100] / 1000.0
+			<< "  p99 " << latency[latency.size() * 99 / 100] / 1000.0
+			<< "  p99.9 " << latency[latency.size() * 999 / 1000] / 1000.0
+			<< "  max " << latency.back() / 1000.0 << endl;
+	}
+	if (cpu && received > 0) {
+		// Clock ticks are coarse (usually 10 ms): runs of a second or more give useful numbers
+		double cpu_seconds = (double)(ticks_after - ticks_before) / sysconf(_SC_CLK_TCK);
+		cout << "server CPU: " << cpu_seconds << " s, " << cpu_seconds * 1e6 / received << " us per message, "
+			<< (long)(cpu_seconds * 100 / seconds) << "% of one CPU" << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,434 @@
+// mqclient.cpp - Asynchronous client of the relay server
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+#include "mqclient.h"
+
+using namespace std;
+
+void mqClientDefaults(MqClientOptions* options, Transport transport)
+{
+	options->transport = transport;
+	options->token = getpid();
+	options->batch_us = 0;
+	options->receive_threads = 1;
+	options->pending_max = MQC_PENDING_MAX;
+	options->durable = false;
+	options->on_receive = NULL;
+	options->on_gone = NULL;
+	options->on_quit = NULL;
+	options->arg = NULL;
+}
+
+static void finish(MqPending* sent, int error)
+{
+	if (sent->done != NULL) {
+		sent->done(error, sent->done_arg);
+	}
+}
+
+static void finishAll(deque<MqPending>* sent, int error)
+{
+	for (size_t i = 0; i < sent->size(); ++i) {
+		finish(&(*sent)[i], error);
+	}
+	sent->clear();
+}
+
+// A message is in the kernel queue; a durable client waits for the server to log it
+static void sent(MqClient* client, MqPending* msg, int error)
+{
+	if (error != 0 || !client->options.durable) {
+		finish(msg, error);
+		return;
+	}
+	pthread_mutex_lock(&client->lock);
+	if (client->acked_ahead == 0 && !client->quit) {
+		client->unacked.push_back(std::move(*msg));
+		pthread_mutex_unlock(&client->lock);
+		return;
+	}
+	bool acked = client->acked_ahead > 0;
+	if (acked) {
+		client->acked_ahead--;
+	}
+	pthread_mutex_unlock(&client->lock);
+	finish(msg, acked ? 0 : EPIPE);
+}
+
+static void sentAll(MqClient* client, deque<MqPending>* batch, int error)
+{
+	for (size_t i = 0; i < batch->size(); ++i) {
+		sent(client, &(*batch)[i], error);
+	}
+	batch->clear();
+}
+
+// The server logged count more of our messages, in the order they were sent
+static void acknowledged(MqClient* client, long count)
+{
+	deque<MqPending> done;
+	pthread_mutex_lock(&client->lock);
+	while (count > 0 && !client->unacked.empty()) {
+		done.push_back(std::move(client->unacked.front()));
+		client->unacked.pop_front();
+		count--;
+	}
+	client->acked_ahead += count;
+	pthread_mutex_unlock(&client->lock);
+	finishAll(&done, 0);
+}
+
+// The batch's way into the kernel; counting its sends tells the sender thread
+// when the messages it added earlier are out
+static int batchForward(Message* msg, void* arg)
+{
+	MqClient* client = (MqClient*)arg;
+	if (msgForward(&client->server, msg, 0) == -1) {
+		return -1;
+	}
+	client->batch_sends++;
+	return 0;
+}
+
+static void* senderThread(void* arg)
+{
+	MqClient* client = (MqClient*)arg;
+	bool batched = client->options.batch_us >= 0;
+	deque<MqPending> round;
+	deque<MqPending> in_batch;   // Added to the batch, not in the kernel yet
+
+	pthread_mutex_lock(&client->lock);
+	while (true) {
+		while (client->pending.empty() && !client->closing) {
+			int timeout = batched ? msgBatchTimeout(&client->batch) : -1;
+			if (timeout == 0) {
+				break;
+			}
+			if (timeout < 0) {
+				pthread_cond_wait(&client->send_ready, &client->lock);
+				continue;
+			}
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += timeout / 1000;
+			deadline.tv_nsec += (timeout % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&client->send_ready, &client->lock, &deadline);
+		}
+		bool closing = client->closing;
+		round.swap(client->pending);
+		pthread_cond_broadcast(&client->send_space);
+		pthread_mutex_unlock(&client->lock);
+
+		for (size_t i = 0; i < round.size(); ++i) {
+			MqPending* msg = &round[i];
+			if (!batched) {
+				int ret = msgSendPayload(&client->server, client->id, msg->dest, msg->payload.data(),
+					msg->payload.size(), client->chunk_max, 0, msg->flags);
+				sent(client, msg, ret == -1 ? errno : 0);
+				continue;
+			}
+			long sends = client->batch_sends;
+			int ret = msgBatchSend(&client->batch, client->id, msg->dest, msg->payload.data(),
+				msg->payload.size(), msg->flags, 0);
+			int error = errno;
+			// Anything the batch sent while taking this message held the earlier ones
+			if (client->batch_sends != sends) {
+				sentAll(client, &in_batch, 0);
+			}
+			if (ret == -1) {
+				sentAll(client, &in_batch, error);
+				sent(client, msg, error);
+			}
+			else if (client->batch.count == 0) {
+				sent(client, msg, 0);
+			}
+			else {
+				in_batch.push_back(std::move(*msg));
+			}
+		}
+		round.clear();
+
+		// Without a delay nothing waits for company that is not already queued
+		if (batched && (client->options.batch_us == 0 || closing || msgBatchTimeout(&client->batch) == 0)) {
+			int ret = msgBatchFlush(&client->batch, 0);
+			sentAll(client, &in_batch, ret == -1 ? errno : 0);
+		}
+
+		pthread_mutex_lock(&client->lock);
+		if (closing && client->pending.empty()) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	pthread_exit(NULL);
+}
+
+static void* callbackThread(void* arg)
+{
+	MqCallbackThread* thread = (MqCallbackThread*)arg;
+	const MqClientOptions* options = &thread->client->options;
+	deque<MqReceived> round;
+
+	pthread_mutex_lock(&thread->lock);
+	while (true) {
+		while (thread->queue.empty() && !thread->stop) {
+			pthread_cond_wait(&thread->ready, &thread->lock);
+		}
+		if (thread->queue.empty()) {
+			break;
+		}
+		round.swap(thread->queue);
+		pthread_mutex_unlock(&thread->lock);
+		for (size_t i = 0; i < round.size(); ++i) {
+			options->on_receive(round[i].source, round[i].payload.data(), round[i].payload.size(), options->arg);
+		}
+		round.clear();
+		pthread_mutex_lock(&thread->lock);
+	}
+	pthread_mutex_unlock(&thread->lock);
+	pthread_exit(NULL);
+}
+
+// Runs the callback here, or on the thread that has all messages from source
+static void deliver(MqClient* client, long source, string* payload)
+{
+	const MqClientOptions* options = &client->options;
+	if (client->callbacks.empty()) {
+		if (options->on_receive != NULL) {
+			options->on_receive(source, payload->data(), payload->size(), options->arg);
+		}
+		return;
+	}
+	MqCallbackThread* thread = client->callbacks[(unsigned long)source % client->callbacks.size()];
+	pthread_mutex_lock(&thread->lock);
+	thread->queue.push_back(MqReceived());
+	thread->queue.back().source = source;
+	thread->queue.back().payload.swap(*payload);
+	if (thread->queue.size() == 1) {
+		pthread_cond_signal(&thread->ready);
+	}
+	pthread_mutex_unlock(&thread->lock);
+}
+
+static void* receiverThread(void* arg)
+{
+	MqClient* client = (MqClient*)arg;
+	const MqClientOptions* options = &client->options;
+	Message* msg = (Message*)malloc(sizeof(Message));
+	MsgReader reader;
+	msgReaderInit(&reader);
+	Reassembly partial;
+	string payload;
+
+	// Runs until Quit, which also answers our unregistration
+	while (true) {
+		if (msgRead(&client->own, &reader, msg, 0) == -1) {
+			if (errno == EINTR || errno == EBADMSG) {
+				continue;
+			}
+			break;   // Queue removed
+		}
+		if ((msg->msgBuf.flags & MSG_ACK) && msg->msgBuf.source == 0 && msg->msgBuf.len == sizeof(long)) {
+			long count;
+			memcpy(&count, msg->msgBuf.buf, sizeof(count));
+			acknowledged(client, count);
+			continue;
+		}
+		if (msg->msgBuf.flags & MSG_UNKNOWN) {
+			if (options->on_gone != NULL) {
+				options->on_gone(msg->msgBuf.source, options->arg);
+			}
+			continue;
+		}
+		if (!msgReassemble(&partial, msg, &payload)) {
+			continue;   // Wait for the remaining chunks
+		}
+		if (msg->msgBuf.source == 0 && payload == "Quit") {
+			break;
+		}
+		deliver(client, msg->msgBuf.source, &payload);
+	}
+	// Nothing is acknowledged after Quit
+	deque<MqPending> lost;
+	pthread_mutex_lock(&client->lock);
+	client->quit = true;
+	lost.swap(client->unacked);
+	pthread_mutex_unlock(&client->lock);
+	finishAll(&lost, EPIPE);
+	if (options->on_quit != NULL) {
+		options->on_quit(options->arg);
+	}
+	msgReaderFree(&reader);
+	free(msg);
+	pthread_exit(NULL);
+}
+
+int mqClientOpen(MqClient* client, const MqClientOptions* options)
+{
+	client->options = *options;
+	if (msgOpenServer(options->transport, false, &client->server) == -1) {
+		return -1;
+	}
+	if (msgOpenOwn(&client->server, options->token, &client->own) == -1) {
+		int saved = errno;
+		msgClose(&client->server);
+		errno = saved;
+		return -1;
+	}
+	client->chunk_max = msgChunkMax(&client->server);
+
+	client->id = msgRegister(&client->server, &client->own, client->chunk_max, &client->peers);
+	if (client->id == -1) {
+		int saved = errno;
+		msgRemove(&client->own);
+		msgClose(&client->own);
+		msgClose(&client->server);
+		errno = saved;
+		return -1;
+	}
+
+	// Without memory for a batch every message goes on its own
+	if (client->options.batch_us >= 0
+		&& msgBatchInit(&client->batch, &client->server, client->id, DEST_SERVER, client->chunk_max,
+			client->options.batch_us) == -1) {
+		client->options.batch_us = -1;
+	}
+	if (client->options.batch_us >= 0) {
+		msgBatchSender(&client->batch, batchForward, client);
+	}
+	client->batch_sends = 0;
+	pthread_mutex_init(&client->lock, NULL);
+	pthread_cond_init(&client->send_ready, NULL);
+	pthread_cond_init(&client->send_space, NULL);
+	client->closing = false;
+	client->quit = false;
+	client->acked_ahead = 0;
+
+	// The threads started here inherit a mask without SIGINT, so Ctrl-C lands
+	// on the caller's threads
+	sigset_t sigint;
+	sigset_t saved;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, &saved);
+
+	client->callbacks.clear();
+	for (int i = 0; client->options.receive_threads > 1 && i < client->options.receive_threads; ++i) {
+		MqCallbackThread* thread = new MqCallbackThread;
+		thread->client = client;
+		thread->stop = false;
+		pthread_mutex_init(&thread->lock, NULL);
+		pthread_cond_init(&thread->ready, NULL);
+		client->callbacks.push_back(thread);
+		if (pthread_create(&thread->tid, NULL, callbackThread, thread) != 0) {
+			cout << "Cannot create callback thread" << endl;
+			exit(-1);
+		}
+	}
+	if (pthread_create(&client->receiver, NULL, receiverThread, client) != 0
+		|| pthread_create(&client->sender, NULL, senderThread, client) != 0) {
+		cout << "Cannot create client thread" << endl;
+		exit(-1);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return 0;
+}
+
+int mqClientSend(MqClient* client, long dest, const char* data, size_t len, unsigned int flags,
+	MqSendCallback done, void* done_arg)
+{
+	pthread_mutex_lock(&client->lock);
+	while (client->pending.size() >= client->options.pending_max && !client->closing) {
+		pthread_cond_wait(&client->send_space, &client->lock);
+	}
+	if (client->closing) {
+		pthread_mutex_unlock(&client->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	client->pending.push_back(MqPending());
+	MqPending* msg = &client->pending.back();
+	msg->dest = dest;
+	msg->flags = flags;
+	msg->payload.assign(data, len);
+	msg->done = done;
+	msg->done_arg = done_arg;
+	// The sender only waits while nothing is pending
+	if (client->pending.size() == 1) {
+		pthread_cond_signal(&client->send_ready);
+	}
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+static void fulfil(int error, void* arg)
+{
+	promise<int>* result = (promise<int>*)arg;
+	result->set_value(error);
+	delete result;
+}
+
+future<int> mqClientSendFuture(MqClient* client, long dest, const char* data, size_t len, unsigned int flags)
+{
+	promise<int>* result = new promise<int>;
+	future<int> sent = result->get_future();
+	if (mqClientSend(client, dest, data, len, flags, fulfil, result) == -1) {
+		fulfil(errno, result);
+	}
+	return sent;
+}
+
+void mqClientClose(MqClient* client)
+{
+	// The sender sends what is pending, then leaves
+	pthread_mutex_lock(&client->lock);
+	client->closing = true;
+	pthread_cond_signal(&client->send_ready);
+	pthread_cond_broadcast(&client->send_space);
+	pthread_mutex_unlock(&client->lock);
+	pthread_join(client->sender, NULL);
+
+	// The server answers with Quit, which ends the receive thread
+	pthread_mutex_lock(&client->lock);
+	bool quit = client->quit;
+	pthread_mutex_unlock(&client->lock);
+	if (!quit) {
+		msgUnregister(&client->server, client->id, client->chunk_max);
+	}
+	pthread_join(client->receiver, NULL);
+
+	for (size_t i = 0; i < client->callbacks.size(); ++i) {
+		MqCallbackThread* thread = client->callbacks[i];
+		pthread_mutex_lock(&thread->lock);
+		thread->stop = true;
+		pthread_cond_signal(&thread->ready);
+		pthread_mutex_unlock(&thread->lock);
+		pthread_join(thread->tid, NULL);
+		pthread_mutex_destroy(&thread->lock);
+		pthread_cond_destroy(&thread->ready);
+		delete thread;
+	}
+	client->callbacks.clear();
+
+	if (client->options.batch_us >= 0) {
+		msgBatchFree(&client->batch);
+	}
+	pthread_mutex_destroy(&client->lock);
+	pthread_cond_destroy(&client->send_ready);
+	pthread_cond_destroy(&client->send_space);
+
+	// Drop what is left for us: our POSIX queue, or our type in the shared System V queue
+	msgRemove(&client->own);
+	msgClose(&client->own);
+	msgClose(&client->server);
+}
@@ -0,0 +1,119 @@
+// mqclient.h - Asynchronous client of the relay server
+//
+// Registers with the server and runs the threads every client needs: a
+// sender that batches what mqClientSend() queues, a receiver that unpacks,
+// reassembles and hands complete payloads to a callback, and optionally more
+// threads running that callback. Messages from one source reach the callback
+// in the order they were sent, always on the same thread.
+#ifndef MQCLIENT_H
+#define MQCLIENT_H
+
+#include <pthread.h>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+#include "msgio.h"
+
+#define MQC_PENDING_MAX 4096   // Default for MqClientOptions::pending_max
+
+// A complete payload from source
+typedef void (*MqReceiveCallback)(long source, const char* data, size_t len, void* arg);
+// The server says client id is not registered (a message to it bounced)
+typedef void (*MqGoneCallback)(long id, void* arg);
+// The server said Quit, in answer to mqClientClose() or because it shuts down
+typedef void (*MqQuitCallback)(void* arg);
+// A message left the client: error is 0 once it is in the kernel queue (durable:
+// once the server logged it), or an errno
+typedef void (*MqSendCallback)(int error, void* arg);
+
+struct MqClientOptions {
+	Transport         transport;
+	long              token;             // Tells clients apart, usually the pid; differs per client of a process
+	long              batch_us;          // -1: every message on its own; 0: batch what queues up while sending;
+	                                     // more: also wait up to this long for more
+	int               receive_threads;   // Threads running on_receive; 1: the receiving thread itself
+	size_t            pending_max;       // Queued messages beyond which mqClientSend() waits
+	bool              durable;           // Completion waits for a durable server's (-d) acknowledgement
+	MqReceiveCallback on_receive;
+	MqGoneCallback    on_gone;           // May be NULL, like on_quit
+	MqQuitCallback    on_quit;
+	void*             arg;               // Passed to the three callbacks
+};
+
+// A message waiting for the sender thread
+struct MqPending {
+	long           dest;
+	unsigned int   flags;
+	std::string    payload;
+	MqSendCallback done;
+	void*          done_arg;
+};
+
+struct MqClient;
+
+// A payload waiting for a callback thread
+struct MqReceived {
+	long        source;
+	std::string payload;
+};
+
+struct MqCallbackThread {
+	MqClient*              client;
+	pthread_t              tid;
+	pthread_mutex_t        lock;
+	pthread_cond_t         ready;
+	std::deque<MqReceived> queue;
+	bool                   stop;   // Leave once the queue is empty
+};
+
+struct MqClient {
+	MqClientOptions options;
+	Endpoint        server;
+	Endpoint        own;
+	size_t          chunk_max;
+	long            id;
+	std::vector<long> peers;         // Registered before us
+
+	pthread_mutex_t lock;            // Everything below but the sender's own state
+	pthread_cond_t  send_ready;      // Something pending, or closing
+	pthread_cond_t  send_space;      // pending dropped below pending_max
+	std::deque<MqPending> pending;
+	bool            closing;
+	bool            quit;            // The server said Quit
+	std::deque<MqPending> unacked;   // Durable: sent, waiting for the server's MSG_ACK
+	long            acked_ahead;     // Acknowledged before the sender thread got to unacked
+	pthread_t       sender;
+	pthread_t       receiver;
+
+	// Sender thread only
+	Batch           batch;
+	long            batch_sends;     // Kernel messages the batch sent
+
+	std::vector<MqCallbackThread*> callbacks;   // Empty for a single receive thread
+};
+
+// Options for transport with one receive thread, batching what queues up
+void mqClientDefaults(MqClientOptions* options, Transport transport);
+
+// Opens the queues, registers and starts the threads. Returns 0, or -1 with
+// errno set; SIGINT interrupts the registration (EINTR). The threads leave
+// SIGINT to the caller's threads.
+int mqClientOpen(MqClient* client, const MqClientOptions* options);
+
+// Queues len bytes for dest, any client id or DEST_ value, and returns at
+// once unless pending_max messages are queued already. done, when given, is
+// called on the sender thread once the message is in the kernel queue or
+// failed; for a durable client on the receive thread once the server logged
+// it. Returns 0, or -1 with errno EPIPE once the client is closing.
+int mqClientSend(MqClient* client, long dest, const char* data, size_t len, unsigned int flags = 0,
+	MqSendCallback done = NULL, void* done_arg = NULL);
+
+// Like mqClientSend(); the future holds what done would get
+std::future<int> mqClientSendFuture(MqClient* client, long dest, const char* data, size_t len, unsigned int flags = 0);
+
+// Sends what is queued, unregisters unless the server quit already, waits for
+// the threads and removes the client's queue
+void mqClientClose(MqClient* client);
+
+#endif//MQCLIENT_H
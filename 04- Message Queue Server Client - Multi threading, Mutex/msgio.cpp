@@ -0,0 +1,598 @@
+// msgio.cpp - Variable-length messages over System V or POSIX message queues
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "msgio.h"
+
+using namespace std;
+
+static const size_t PREVIEW_LEN = 64;
+static const size_t FANOUT_HEADER = 8;   // uint32_t count and padding
+
+int msgTransport(const char* name, Transport* transport)
+{
+	if (strcmp(name, "sysv") == 0) {
+		*transport = TRANSPORT_SYSV;
+		return 0;
+	}
+	if (strcmp(name, "posix") == 0) {
+		*transport = TRANSPORT_POSIX;
+		return 0;
+	}
+	return -1;
+}
+
+static long readLimit(const char* path, long fallback)
+{
+	FILE* file = fopen(path, "r");
+	long value;
+	if (file == NULL) {
+		return fallback;
+	}
+	if (fscanf(file, "%ld", &value) != 1) {
+		value = fallback;
+	}
+	fclose(file);
+	return value;
+}
+
+// Creates or opens a POSIX queue. Everybody sizes queues the same way, so a
+// message that fits one queue fits all of them.
+static int posixOpen(const char* name, int oflag)
+{
+	struct mq_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = readLimit("/proc/sys/fs/mqueue/msg_max", MQ_MAXMSG);
+	attr.mq_msgsize = readLimit("/proc/sys/fs/mqueue/msgsize_max", MQ_MSGSIZE);
+	if (attr.mq_maxmsg > MQ_MAXMSG) {
+		attr.mq_maxmsg = MQ_MAXMSG;
+	}
+	if (attr.mq_msgsize > MQ_MSGSIZE) {
+		attr.mq_msgsize = MQ_MSGSIZE;
+	}
+	// Queue memory counts against RLIMIT_MSGQUEUE; take what the hard limit allows
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_MSGQUEUE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_MSGQUEUE, &limit);
+	}
+	return mq_open(name, oflag, 0666, &attr);
+}
+
+static string clientQueueName(long token)
+{
+	return MQ_CLIENT_PREFIX + to_string(token);
+}
+
+int msgOpenServer(Transport transport, bool create, Endpoint* inbox)
+{
+	inbox->transport = transport;
+	inbox->mtype = SERVER_MTYPE;
+	inbox->owner = 0;
+	if (transport == TRANSPORT_POSIX) {
+		inbox->id = create ? posixOpen(MQ_SERVER_NAME, O_RDONLY | O_CREAT) : mq_open(MQ_SERVER_NAME, O_WRONLY);
+		return inbox->id == -1 ? -1 : 0;
+	}
+	// ftok to generate unique key, msgget creates the queue
+	key_t key = ftok("serverclient", 65);
+	if (key == -1) {
+		return -1;
+	}
+	inbox->id = msgget(key, 0666 | IPC_CREAT);
+	return inbox->id == -1 ? -1 : 0;
+}
+
+int msgOpenOwn(const Endpoint* server, long token, Endpoint* own)
+{
+	own->transport = server->transport;
+	own->owner = token;
+	// Until registration assigns an id, the reply comes to a type only this client reads
+	own->mtype = REPLY_MTYPE_BASE + token;
+	if (server->transport == TRANSPORT_POSIX) {
+		own->id = posixOpen(clientQueueName(token).c_str(), O_RDONLY | O_CREAT);
+		return own->id == -1 ? -1 : 0;
+	}
+	own->id = server->id;
+	return 0;
+}
+
+int msgOpenClient(const Endpoint* inbox, long token, Endpoint* client)
+{
+	client->transport = inbox->transport;
+	client->owner = token;
+	client->mtype = REPLY_MTYPE_BASE + token;
+	if (inbox->transport == TRANSPORT_POSIX) {
+		client->id = mq_open(clientQueueName(token).c_str(), O_WRONLY);
+		return client->id == -1 ? -1 : 0;
+	}
+	client->id = inbox->id;
+	return 0;
+}
+
+void msgAssignId(Endpoint* endpoint, long id)
+{
+	endpoint->mtype = id;
+}
+
+void msgRemove(const Endpoint* endpoint)
+{
+	if (endpoint->transport == TRANSPORT_POSIX) {
+		mq_unlink(endpoint->owner == 0 ? MQ_SERVER_NAME : clientQueueName(endpoint->owner).c_str());
+		return;
+	}
+	if (endpoint->owner == 0) {
+		msgctl(endpoint->id, IPC_RMID, NULL);
+		return;
+	}
+	// A client's part of the shared queue is its type
+	Message* msg = (Message*)malloc(sizeof(Message));
+	if (msg != NULL) {
+		while (msgrcv(endpoint->id, msg, sizeof(MesgBuffer), endpoint->mtype, IPC_NOWAIT) != -1) {
+		}
+		free(msg);
+	}
+}
+
+void msgClose(Endpoint* endpoint)
+{
+	if (endpoint->transport == TRANSPORT_POSIX && endpoint->id != -1) {
+		mq_close(endpoint->id);
+	}
+	endpoint->id = -1;
+}
+
+size_t msgChunkMax(const Endpoint* endpoint)
+{
+	size_t limit = sizeof(MesgBuffer);
+
+	if (endpoint->transport == TRANSPORT_POSIX) {
+		struct mq_attr attr;
+		if (mq_getattr(endpoint->id, &attr) == 0 && (size_t)attr.mq_msgsize < limit) {
+			limit = attr.mq_msgsize;
+		}
+		return limit > MSG_HEADER_SIZE ? limit - MSG_HEADER_SIZE : 0;
+	}
+
+	// IPC_INFO fills a struct msginfo with the system-wide limits
+	struct msginfo info;
+	if (msgctl(0, IPC_INFO, (struct msqid_ds*)&info) >= 0 && (size_t)info.msgmax < limit) {
+		limit = info.msgmax;
+	}
+	// A message larger than the queue itself could never be sent
+	struct msqid_ds stat;
+	if (msgctl(endpoint->id, IPC_STAT, &stat) == 0 && stat.msg_qbytes < limit) {
+		limit = stat.msg_qbytes;
+	}
+	return limit > MSG_HEADER_SIZE ? limit - MSG_HEADER_SIZE : 0;
+}
+
+// A deadline already past: the timed POSIX calls then behave like IPC_NOWAIT
+static const struct timespec no_wait = { 0, 0 };
+
+// Sends msg's header and used payload; the one place both transports send
+static int sendRaw(const Endpoint* to, Message* msg, int msgflg)
+{
+	size_t size = MSG_HEADER_SIZE + msg->msgBuf.len;
+	if (to->transport == TRANSPORT_POSIX) {
+		unsigned int prio = (msg->msgBuf.flags & MSG_URGENT) ? MQ_PRIO_URGENT : 0;
+		int ret = (msgflg & IPC_NOWAIT)
+			? mq_timedsend(to->id, (const char*)&msg->msgBuf, size, prio, &no_wait)
+			: mq_send(to->id, (const char*)&msg->msgBuf, size, prio);
+		if (ret == -1 && errno == ETIMEDOUT) {
+			errno = EAGAIN;
+		}
+		return ret;
+	}
+	msg->mtype = to->mtype;
+	return msgsnd(to->id, msg, size, msgflg);
+}
+
+// Sends data in chunks of at most chunk_max bytes, each starting with prefix
+static int sendChunks(const Endpoint* to, long source, long dest, unsigned int flags,
+	const char* prefix, size_t prefix_len, const char* data, size_t len, size_t chunk_max, int msgflg)
+{
+	// Each chunk must move the payload on, or the list not fit at all
+	if (prefix_len > chunk_max || (prefix_len == chunk_max && len > 0)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	size_t room = chunk_max - prefix_len;
+	Message* msg = (Message*)malloc(sizeof(long) + MSG_HEADER_SIZE + prefix_len + (len < room ? len : room));
+	if (msg == NULL) {
+		return -1;
+	}
+	msg->msgBuf.source = source;
+	msg->msgBuf.dest = dest;
+	if (prefix_len > 0) {
+		memcpy(msg->msgBuf.buf, prefix, prefix_len);
+	}
+
+	// An empty payload is still one message
+	size_t offset = 0;
+	do {
+		size_t chunk = len - offset < room ? len - offset : room;
+		msg->msgBuf.len = prefix_len + chunk;
+		msg->msgBuf.flags = flags | (offset + chunk < len ? CHUNK_MORE : 0);
+		if (chunk > 0) {
+			memcpy(msg->msgBuf.buf + prefix_len, data + offset, chunk);
+		}
+		if (sendRaw(to, msg, msgflg) == -1) {
+			int saved = errno;
+			free(msg);
+			errno = saved;
+			return -1;
+		}
+		offset += chunk;
+	} while (offset < len);
+
+	free(msg);
+	return 0;
+}
+
+int msgSendPayload(const Endpoint* to, long source, long dest,
+	const char* data, size_t len, size_t chunk_max, int msgflg, unsigned int flags)
+{
+	return sendChunks(to, source, dest, flags, NULL, 0, data, len, chunk_max, msgflg);
+}
+
+int msgSendFanout(const Endpoint* server, long source, const long* ids, int count,
+	const char* data, size_t len, size_t chunk_max, int msgflg, unsigned int flags)
+{
+	// uint32_t count, padding to keep the ids aligned, then the ids
+	string list(FANOUT_HEADER + (size_t)count * sizeof(long), '\0');
+	uint32_t n = count;
+	memcpy(&list[0], &n, sizeof(n));
+	memcpy(&list[FANOUT_HEADER], ids, (size_t)count * sizeof(long));
+	return sendChunks(server, source, DEST_FANOUT, flags,
+		list.data(), list.size(), data, len, chunk_max, msgflg);
+}
+
+int msgFanoutList(const MesgBuffer* buf, const long** ids, const char** body, size_t* len)
+{
+	uint32_t count;
+	if (buf->len < FANOUT_HEADER) {
+		return -1;
+	}
+	memcpy(&count, buf->buf, sizeof(count));
+	size_t list = FANOUT_HEADER + (size_t)count * sizeof(long);
+	if (list > buf->len) {
+		return -1;
+	}
+	*ids = (const long*)(buf->buf + FANOUT_HEADER);
+	*body = buf->buf + list;
+	*len = buf->len - list;
+	return count;
+}
+
+long msgRegister(const Endpoint* server, Endpoint* own, size_t chunk_max, vector<long>* peers)
+{
+	// The source tells the server where to answer, the payload who to check is alive
+	pid_t pid = getpid();
+	if (msgSendPayload(server, own->owner, DEST_SERVER, (const char*)&pid, sizeof(pid), chunk_max, 0, MSG_REGISTER) == -1) {
+		return -1;
+	}
+
+	// A long list of peers comes in chunks
+	Message* msg = (Message*)malloc(sizeof(Message));
+	if (msg == NULL) {
+		return -1;
+	}
+	Reassembly partial;
+	string list;
+	long id = -1;
+	while (msgReceive(own, msg, 0) != -1) {
+		if ((msg->msgBuf.flags & MSG_WELCOME) && msgReassemble(&partial, msg, &list)) {
+			id = msg->msgBuf.dest;
+			break;
+		}
+	}
+	int saved = errno;
+	free(msg);
+	if (id == -1) {
+		errno = saved;
+		return -1;
+	}
+	msgAssignId(own, id);
+	peers->resize(list.size() / sizeof(long));
+	if (!peers->empty()) {
+		memcpy(&(*peers)[0], list.data(), peers->size() * sizeof(long));
+	}
+	return id;
+}
+
+int msgUnregister(const Endpoint* server, long id, size_t chunk_max)
+{
+	return msgSendPayload(server, id, DEST_SERVER, NULL, 0, chunk_max, 0, MSG_UNREGISTER);
+}
+
+int msgForward(const Endpoint* to, Message* msg, int msgflg)
+{
+	return sendRaw(to, msg, msgflg);
+}
+
+ssize_t msgReceive(const Endpoint* from, Message* msg, int msgflg)
+{
+	ssize_t size;
+	if (from->transport == TRANSPORT_POSIX) {
+		// The buffer must be at least the queue's mq_msgsize, which MesgBuffer is
+		size = (msgflg & IPC_NOWAIT)
+			? mq_timedreceive(from->id, (char*)&msg->msgBuf, sizeof(MesgBuffer), NULL, &no_wait)
+			: mq_receive(from->id, (char*)&msg->msgBuf, sizeof(MesgBuffer), NULL);
+		if (size == -1 && errno == ETIMEDOUT) {
+			errno = EAGAIN;
+		}
+	}
+	else {
+		size = msgrcv(from->id, msg, sizeof(MesgBuffer), from->mtype, msgflg);
+		if (size == -1 && errno == ENOMSG) {
+			errno = EAGAIN;
+		}
+	}
+	if (size == -1) {
+		return -1;
+	}
+	// Trust the kernel's byte count over the sender's len field
+	if ((size_t)size < MSG_HEADER_SIZE || msg->msgBuf.len != (size_t)size - MSG_HEADER_SIZE) {
+		errno = EBADMSG;
+		return -1;
+	}
+	return msg->msgBuf.len;
+}
+
+Message* msgCopy(const Message* msg)
+{
+	size_t size = sizeof(long) + MSG_HEADER_SIZE + msg->msgBuf.len;
+	Message* copy = (Message*)malloc(size);
+	if (copy != NULL) {
+		memcpy(copy, msg, size);
+	}
+	return copy;
+}
+
+Message* msgAlloc(long source, long dest, unsigned int flags, const char* data, size_t len)
+{
+	Message* msg = (Message*)malloc(sizeof(long) + MSG_HEADER_SIZE + len);
+	if (msg != NULL) {
+		msg->mtype = 0;
+		msg->msgBuf.source = source;
+		msg->msgBuf.dest = dest;
+		msg->msgBuf.len = len;
+		msg->msgBuf.flags = flags;
+		if (len > 0) {
+			memcpy(msg->msgBuf.buf, data, len);
+		}
+	}
+	return msg;
+}
+
+bool msgReassemble(Reassembly* partial, const Message* msg, string* payload)
+{
+	const MesgBuffer* buf = &msg->msgBuf;
+	pair<long, bool> key(buf->source, (buf->flags & MSG_URGENT) != 0);
+	Reassembly::iterator it = partial->find(key);
+	if (it == partial->end()) {
+		if (!(buf->flags & CHUNK_MORE)) {
+			// Fits one message: the common case costs no map entry
+			payload->assign(buf->buf, buf->len);
+			return true;
+		}
+		it = partial->insert(make_pair(key, string())).first;
+	}
+	it->second.append(buf->buf, buf->len);
+	if (buf->flags & CHUNK_MORE) {
+		return false;
+	}
+	payload->swap(it->second);
+	partial->erase(it);
+	return true;
+}
+
+string msgPreview(const char* data, size_t len)
+{
+	if (len <= PREVIEW_LEN) {
+		return string(data, len);
+	}
+	return string(data, PREVIEW_LEN) + "... (" + to_string(len) + " bytes)";
+}
+
+// Records are padded so the next header stays aligned
+static size_t recordSize(size_t len)
+{
+	return MSG_HEADER_SIZE + ((len + 7) & ~(size_t)7);
+}
+
+static uint64_t monotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int msgBatchInit(Batch* batch, const Endpoint* to, long source, long dest, size_t chunk_max, long delay_us)
+{
+	batch->to = *to;
+	batch->source = source;
+	batch->dest = dest;
+	batch->chunk_max = chunk_max;
+	batch->delay_ns = delay_us > 0 ? (uint64_t)delay_us * 1000 : 0;
+	batch->first_ns = 0;
+	batch->count = 0;
+	batch->sender = NULL;
+	batch->sender_arg = NULL;
+	batch->msg = (Message*)malloc(sizeof(long) + MSG_HEADER_SIZE + chunk_max);
+	if (batch->msg == NULL) {
+		return -1;
+	}
+	batch->msg->msgBuf.len = 0;
+	return 0;
+}
+
+void msgBatchFree(Batch* batch)
+{
+	free(batch->msg);
+	batch->msg = NULL;
+	batch->count = 0;
+}
+
+void msgBatchSender(Batch* batch, BatchSender sender, void* arg)
+{
+	batch->sender = sender;
+	batch->sender_arg = arg;
+}
+
+static int batchSendRaw(Batch* batch, Message* msg, int msgflg)
+{
+	if (batch->sender != NULL) {
+		return batch->sender(msg, batch->sender_arg);
+	}
+	return sendRaw(&batch->to, msg, msgflg);
+}
+
+int msgBatchFlush(Batch* batch, int msgflg)
+{
+	if (batch->count == 0) {
+		return 0;
+	}
+	MesgBuffer* buf = &batch->msg->msgBuf;
+	if (batch->count == 1) {
+		// No need for the batch header: the record becomes the message
+		MesgBuffer* record = (MesgBuffer*)buf->buf;
+		memmove(buf, record, MSG_HEADER_SIZE + record->len);
+	}
+	else {
+		buf->source = batch->source;
+		buf->dest = batch->dest;
+		buf->flags = MSG_BATCH;
+	}
+	int ret = batchSendRaw(batch, batch->msg, msgflg);
+	buf->len = 0;
+	batch->count = 0;
+	return ret;
+}
+
+// Room for a record of len payload bytes, sending the batch first when it
+// lacks it. NULL with errno set when sending failed.
+static MesgBuffer* batchReserve(Batch* batch, size_t len, int msgflg)
+{
+	if (batch->msg->msgBuf.len + recordSize(len) > batch->chunk_max && msgBatchFlush(batch, msgflg) == -1) {
+		return NULL;
+	}
+	if (batch->count == 0 && batch->delay_ns > 0) {
+		batch->first_ns = monotonicNs();
+	}
+	return (MesgBuffer*)(batch->msg->msgBuf.buf + batch->msg->msgBuf.len);
+}
+
+// Takes the record written at the reserved place into the batch
+static int batchCommit(Batch* batch, MesgBuffer* record, int msgflg)
+{
+	size_t size = recordSize(record->len);
+	memset(record->buf + record->len, 0, size - MSG_HEADER_SIZE - record->len);
+	batch->msg->msgBuf.len += size;
+	batch->count++;
+	if (batch->delay_ns > 0 && monotonicNs() - batch->first_ns >= batch->delay_ns) {
+		return msgBatchFlush(batch, msgflg);
+	}
+	return 0;
+}
+
+int msgBatchAdd(Batch* batch, Message* msg, int msgflg)
+{
+	if (recordSize(msg->msgBuf.len) > batch->chunk_max || (msg->msgBuf.flags & MSG_URGENT)) {
+		// Urgent messages keep their priority by travelling alone
+		if (msgBatchFlush(batch, msgflg) == -1) {
+			return -1;
+		}
+		return batchSendRaw(batch, msg, msgflg);
+	}
+	MesgBuffer* record = batchReserve(batch, msg->msgBuf.len, msgflg);
+	if (record == NULL) {
+		return -1;
+	}
+	memcpy(record, &msg->msgBuf, MSG_HEADER_SIZE + msg->msgBuf.len);
+	return batchCommit(batch, record, msgflg);
+}
+
+int msgBatchSend(Batch* batch, long source, long dest, const char* data, size_t len,
+	unsigned int flags, int msgflg)
+{
+	if (recordSize(len) > batch->chunk_max || (flags & MSG_URGENT)) {
+		if (msgBatchFlush(batch, msgflg) == -1) {
+			return -1;
+		}
+		return msgSendPayload(&batch->to, source, dest, data, len, batch->chunk_max, msgflg, flags);
+	}
+	MesgBuffer* record = batchReserve(batch, len, msgflg);
+	if (record == NULL) {
+		return -1;
+	}
+	record->source = source;
+	record->dest = dest;
+	record->len = len;
+	record->flags = flags;
+	if (len > 0) {
+		memcpy(record->buf, data, len);
+	}
+	return batchCommit(batch, record, msgflg);
+}
+
+int msgBatchTimeout(const Batch* batch)
+{
+	if (batch->count == 0 || batch->delay_ns == 0) {
+		return -1;
+	}
+	uint64_t now = monotonicNs();
+	uint64_t due = batch->first_ns + batch->delay_ns;
+	return now >= due ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+int msgReaderInit(MsgReader* reader)
+{
+	reader->batch = (Message*)malloc(sizeof(Message));
+	reader->offset = 0;
+	reader->end = 0;
+	return reader->batch == NULL ? -1 : 0;
+}
+
+void msgReaderFree(MsgReader* reader)
+{
+	free(reader->batch);
+	reader->batch = NULL;
+	reader->end = 0;
+}
+
+ssize_t msgRead(const Endpoint* from, MsgReader* reader, Message* msg, int msgflg)
+{
+	while (true) {
+		if (reader->offset < reader->end) {
+			const MesgBuffer* record = (const MesgBuffer*)(reader->batch->msgBuf.buf + reader->offset);
+			size_t room = reader->end - reader->offset;
+			// Records must lie within the batch, and batches do not nest
+			if (room < MSG_HEADER_SIZE || recordSize(record->len) > room || (record->flags & MSG_BATCH)) {
+				reader->end = 0;
+				errno = EBADMSG;
+				return -1;
+			}
+			memcpy(&msg->msgBuf, record, MSG_HEADER_SIZE + record->len);
+			reader->offset += recordSize(record->len);
+			return record->len;
+		}
+		// Plain messages land in msg directly; only batches are copied aside
+		ssize_t len = msgReceive(from, msg, msgflg);
+		if (len == -1 || !(msg->msgBuf.flags & MSG_BATCH)) {
+			return len;
+		}
+		memcpy(&reader->batch->msgBuf, &msg->msgBuf, MSG_HEADER_SIZE + len);
+		reader->offset = 0;
+		reader->end = len;
+	}
+}
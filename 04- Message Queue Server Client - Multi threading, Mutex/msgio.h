@@ -0,0 +1,179 @@
+// msgio.h - Variable-length messages over System V or POSIX message queues
+//
+// A message costs the kernel MSG_HEADER_SIZE plus the payload bytes actually
+// used, not sizeof(MesgBuffer). Payloads longer than one message may carry
+// are sent as consecutive chunks flagged CHUNK_MORE, the last without it;
+// the receiver joins them per source with msgReassemble().
+//
+// Two transports carry the same messages. System V has one queue for
+// everybody: the server reads SERVER_MTYPE, every client its own type. POSIX
+// gives every process a queue of its own (MQ_SERVER_NAME, and MQ_CLIENT_PREFIX
+// plus a token per client); those are file descriptors that epoll can wait
+// on, and MSG_URGENT messages overtake the others.
+#ifndef MSGIO_H
+#define MSGIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "client.h"
+
+#define MQ_SERVER_NAME "/mqrelay"
+#define MQ_CLIENT_PREFIX "/mqrelay."
+#define MQ_MAXMSG 64          // Queue depth asked for; /proc/sys/fs/mqueue/msg_max caps it
+#define MQ_MSGSIZE 8192       // Largest message; /proc/sys/fs/mqueue/msgsize_max caps it
+#define MQ_PRIO_URGENT 1      // POSIX priority of MSG_URGENT messages
+
+enum Transport {
+	TRANSPORT_SYSV,
+	TRANSPORT_POSIX
+};
+
+// Where messages go to or come from
+struct Endpoint {
+	Transport transport;
+	int       id;      // System V queue id, or the POSIX queue descriptor
+	long      mtype;   // System V: the type read or written
+	long      owner;   // Token of the client whose queue this is, 0 for the server
+};
+
+// Parses "sysv" or "posix". Returns 0, or -1 for anything else.
+int msgTransport(const char* name, Transport* transport);
+
+// The server's inbox: created by the server, opened for sending by clients.
+// Returns 0, or -1 with errno set.
+int msgOpenServer(Transport transport, bool create, Endpoint* inbox);
+
+// Creates the queue a client receives on. token tells concurrent clients
+// apart and is usually the pid. Returns 0, or -1 with errno set.
+int msgOpenOwn(const Endpoint* server, long token, Endpoint* own);
+
+// Server side: the queue of the client registering with token
+int msgOpenClient(const Endpoint* inbox, long token, Endpoint* client);
+
+// Switches an endpoint to the id assigned at registration (System V: the
+// client's type from then on; POSIX: nothing changes)
+void msgAssignId(Endpoint* endpoint, long id);
+
+// Deletes what the endpoint reads: the System V queue for the server's inbox,
+// the messages left for its type for a client; the POSIX queue's name
+void msgRemove(const Endpoint* endpoint);
+
+// Releases the descriptor (POSIX only)
+void msgClose(Endpoint* endpoint);
+
+// Largest payload one message to or from endpoint may carry, at most BUF_LEN
+size_t msgChunkMax(const Endpoint* endpoint);
+
+// Sends len bytes from source to dest, split into chunks of at most
+// chunk_max bytes. msgflg may be IPC_NOWAIT for either transport.
+// Returns 0, or -1 with errno set.
+int msgSendPayload(const Endpoint* to, long source, long dest,
+	const char* data, size_t len, size_t chunk_max, int msgflg, unsigned int flags = 0);
+
+// Sends len bytes to each of count clients with a single message into the
+// kernel; the server makes the copies. The id list is repeated in every chunk.
+int msgSendFanout(const Endpoint* server, long source, const long* ids, int count,
+	const char* data, size_t len, size_t chunk_max, int msgflg, unsigned int flags = 0);
+
+// Registers with the server and returns the assigned client id, or -1 with
+// errno set. Blocks until the server answers on own, which is switched to the
+// new id; SIGINT interrupts it (EINTR). peers receives the ids registered
+// before this one.
+long msgRegister(const Endpoint* server, Endpoint* own, size_t chunk_max, std::vector<long>* peers);
+
+// Tells the server client id is leaving; it answers with "Quit"
+int msgUnregister(const Endpoint* server, long id, size_t chunk_max);
+
+// Sends a received message on unchanged
+int msgForward(const Endpoint* to, Message* msg, int msgflg);
+
+// Receives one message into msg. Returns the payload length, or -1 with
+// errno set (EAGAIN when IPC_NOWAIT finds nothing).
+ssize_t msgReceive(const Endpoint* from, Message* msg, int msgflg);
+
+// Heap copy of msg holding only its used bytes; release with free()
+Message* msgCopy(const Message* msg);
+
+// Heap message of exactly the given payload; release with free()
+Message* msgAlloc(long source, long dest, unsigned int flags, const char* data, size_t len);
+
+// Splits the id list off a DEST_FANOUT payload. Returns the number of ids,
+// or -1 when the payload is too short for its list.
+int msgFanoutList(const MesgBuffer* buf, const long** ids, const char** body, size_t* len);
+
+// Partial payloads by source and urgency; an urgent message may overtake
+// the chunks of an ordinary one from the same source
+typedef std::map<std::pair<long, bool>, std::string> Reassembly;
+
+// Adds a received chunk. Returns true and sets payload once the chunk
+// completing a payload has arrived.
+bool msgReassemble(Reassembly* partial, const Message* msg, std::string* payload);
+
+// Several logical messages for the same queue travel in one kernel message
+// flagged MSG_BATCH. Its payload is a sequence of records, each a MesgBuffer
+// header and its payload padded to 8 bytes, in the order they were added.
+// A batch is sent once it is full (chunk_max), once its oldest record is
+// delay_us old when the next is added, or on msgBatchFlush(). A batch of one
+// goes out as the plain message.
+
+// Sends what a batch produces instead of msgsnd()/mq_send(); 0 or -1 with errno
+typedef int (*BatchSender)(Message* msg, void* arg);
+
+struct Batch {
+	Endpoint to;
+	long     source;      // Header of the message carrying the batch
+	long     dest;
+	size_t   chunk_max;
+	uint64_t delay_ns;    // 0: only full batches and msgBatchFlush() send
+	uint64_t first_ns;    // When the oldest record went in
+	unsigned count;       // Records
+	Message* msg;         // Header plus chunk_max bytes
+	BatchSender sender;   // NULL: send to the endpoint directly
+	void*       sender_arg;
+};
+
+// Returns 0, or -1 when out of memory
+int msgBatchInit(Batch* batch, const Endpoint* to, long source, long dest, size_t chunk_max, long delay_us);
+void msgBatchFree(Batch* batch);
+
+// Routes what msgBatchAdd() and msgBatchFlush() send through sender, which
+// gets the message ready to go (mtype aside) and may keep a copy of it
+void msgBatchSender(Batch* batch, BatchSender sender, void* arg);
+
+// Adds a message as it would otherwise be sent on its own. Messages too large
+// to share and MSG_URGENT ones are sent straight away, after the batch.
+// Returns 0, or -1 with errno set when sending failed.
+int msgBatchAdd(Batch* batch, Message* msg, int msgflg);
+
+// Adds a payload from source to dest, chunked as msgSendPayload() would
+int msgBatchSend(Batch* batch, long source, long dest, const char* data, size_t len,
+	unsigned int flags, int msgflg);
+
+// Sends what the batch holds. The records are gone either way.
+int msgBatchFlush(Batch* batch, int msgflg);
+
+// Milliseconds until the oldest record is due, 0 when it is, -1 for an
+// empty batch or one without a delay
+int msgBatchTimeout(const Batch* batch);
+
+// Receives messages one at a time, unpacking batches
+struct MsgReader {
+	Message* batch;    // The batch being unpacked
+	size_t   offset;   // Next record
+	size_t   end;      // Bytes of records, 0 when none are left
+};
+
+int msgReaderInit(MsgReader* reader);
+void msgReaderFree(MsgReader* reader);
+
+// Like msgReceive(), but a batch is handed out record by record, before the
+// next message is received
+ssize_t msgRead(const Endpoint* from, MsgReader* reader, Message* msg, int msgflg);
+
+// The start of the payload for logging, with its size when cut short
+std::string msgPreview(const char* data, size_t len);
+
+#endif//MSGIO_H
@@ -1,25 +1,151 @@
-#include <errno.h> 
-#include <iostream> 
-#include <queue> 
-#include <signal.h> 
+#include <errno.h>
+#include <mqueue.h>
+#include <stdlib.h>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include <queue>
+#include <signal.h>
+#include <sstream>
 #include <string.h>
-#include <sys/ipc.h> 
-#include <sys/msg.h> 
+#include <sys/epoll.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 #include "client.h"
+#include "msgio.h"
+#include "wal.h"
 
 
 using namespace std;
 
-key_t key;
-int msgid;
-bool is_running;
-queue<Message> message;
+Transport transport = TRANSPORT_SYSV;
+Endpoint inbox;
+size_t chunk_max;   // Largest payload of one message on the inbox
+volatile sig_atomic_t is_running;
+bool quiet;         // -q: no line per message
+bool batching = true;   // -s clears it: every message is sent on its own
 
-/* shared mutex between receive thread and send */
+// What a worker does when a client's queue has no room (-p)
+enum Policy {
+	POLICY_BLOCK,   // Wait in msgsnd(), as everybody else then does on a shared queue
+	POLICY_SPILL,   // Keep the messages in memory until there is room
+	POLICY_DROP     // Same, but at most overflow_cap bytes per client; the oldest go
+};
+Policy policy = POLICY_DROP;
+size_t overflow_cap = 16 << 20;   // -c
+int stats_interval;           // -m: seconds between backlog reports, 0 for none
+const char* wal_path;         // -d: durable, messages are logged here first
+Wal wal;
+
+// System V: bytes a client may have in the shared queue before its worker takes
+// back what it has not read. Adapted to how full the queue is, never more than
+// half of it.
+atomic<size_t> kernel_cap;
+size_t kernel_cap_min;   // One message of the largest size
+size_t kernel_cap_max;   // Half the queue
+
+#define RETRY_MIN_US 100         // A backed-up client is retried this soon...
+#define RETRY_MAX_US 1000000     // ...and backs off to this while it reads nothing
+#define SHUTDOWN_DRAIN_MS 1000   // How long overflows may take to get out at shutdown
+
+// A logged message (-d) until every copy of it is in a client's queue
+struct Tracked {
+	uint64_t    seq;
+	atomic<int> copies;   // Deliveries not sent yet, plus one while it is routed
+};
+
+// A message on its way to one client
+struct Delivery {
+	long     client;    // Id, picks the worker
+	Endpoint to;
+	Message* msg;       // Exact-size copy; NULL when the client died and its queue goes
+	bool     last;      // Close the endpoint once msg is sent
+	Tracked* tracked;   // -d: the logged message this is a copy of
+};
+
+// Dispatch is split over worker threads by destination. A destination always
+// maps to the same worker, so its messages leave in the order they arrived,
+// while workers for different destinations send in parallel.
+struct Destination;
+
+struct Worker {
+	pthread_t       tid;
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;       // Signalled when a message is queued or receiving ends
+	queue<Delivery> message;
+	bool            receiving;   // Cleared once the receive thread has left
+	long            dispatched;
+	// Dispatch thread only
+	map<long, Destination*> destinations;
+	set<long>       backed_up;   // Clients with an overflow
+	Message*        scratch;     // Room for a message taken back from the queue
+	// Read by main for the backlog report
+	atomic<long>    backlog;     // Messages in overflows
+	atomic<long>    dropped;
+	atomic<long>    reclaimed;   // Taken back from the shared queue to be sent again
+	atomic<long>    worst_client;
+	atomic<long>    worst_backlog;
+};
+
+// A client as its worker sees it
+struct Destination {
+	long            id;
+	Endpoint        to;
+	Worker*         worker;
+	bool            batched;
+	Batch           batch;
+	deque<Message*> overflow;    // Ready to send, waiting for room; oldest first
+	size_t          overflow_bytes;
+	size_t          in_kernel;   // System V: bytes sent since the last look at what is unread
+	uint64_t        retry_us;    // When to try the overflow again, monotonic
+	uint64_t        backoff_us;
+	bool            closing;     // Unregistered: close once the overflow is out
+};
+
+int num_workers;
+Worker* workers;
+
+// Registered clients by id. Only the receive thread touches the table while
+// it runs; main reads it once the receive thread is done.
+struct ClientInfo {
+	pid_t    pid;
+	long     sent;       // Messages from this client
+	Endpoint endpoint;
+};
+map<long, ClientInfo> clients;
+long next_id = 1;
+
+/* shared mutex between receive thread and main thread */
 pthread_mutex_t lock_x;
+/* signalled when the receive thread is done, under lock_x */
+pthread_cond_t receive_done;
+bool receiving;
 
 void* recv_func(void* arg);
+void* dispatch_func(void* arg);
+void wakeReceiver();
+void sampleQueue(bool report);
+void acknowledge(long client, const Endpoint* to, long count, void* arg);
+void restore(WalState* state);
+
+static uint64_t monotonicUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t monotonicMs()
+{
+	return monotonicUs() / 1000;
+}
 
 static void shutdownHandler(int sig)
 {
@@ -31,9 +157,84 @@ static void shutdownHandler(int sig)
 	}
 }
 
-int main()
+static void usage(const char* name)
+{
+	cout << "usage: " << name << " [-t sysv|posix] [-w workers] [-s] [-p block|spill|drop] [-c cap] [-m seconds] [-d log] [-q]" << endl;
+	cout << "  -t transport  System V queue shared by all (default) or a POSIX queue per client" << endl;
+	cout << "  -w workers    dispatch threads, destinations are split between them (default: online CPUs)" << endl;
+	cout << "  -s            send every message on its own instead of batching them per client" << endl;
+	cout << "  -p policy     when a client's queue is full: wait for it, keep its messages in memory," << endl;
+	cout << "                or keep at most cap and drop the oldest (default drop)" << endl;
+	cout << "  -c cap        bytes kept per client under -p drop (default 16 MB)" << endl;
+	cout << "  -m seconds    report queue depth and backlog this often" << endl;
+	cout << "  -d log        durable: log messages before relaying them and resend what was not" << endl;
+	cout << "                delivered after a restart; implies -p block" << endl;
+	cout << "  -q            do not print every message" << endl;
+}
+
+int main(int argc, char* argv[])
 {
-	pthread_t tid_r, tid_w;
+	pthread_t tid_r;
+
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	bool policy_given = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:w:sp:c:m:d:q")) != -1) {
+		switch (opt) {
+		case 't':
+			if (msgTransport(optarg, &transport) == -1) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
+		case 's':
+			batching = false;
+			break;
+		case 'p':
+			policy_given = true;
+			if (strcmp(optarg, "block") == 0) {
+				policy = POLICY_BLOCK;
+			}
+			else if (strcmp(optarg, "spill") == 0) {
+				policy = POLICY_SPILL;
+			}
+			else if (strcmp(optarg, "drop") == 0) {
+				policy = POLICY_DROP;
+			}
+			else {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'c':
+			overflow_cap = atol(optarg);
+			break;
+		case 'm':
+			stats_interval = atoi(optarg);
+			break;
+		case 'd':
+			wal_path = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	// A message counts as delivered once a client's queue has it, not while it
+	// waits in an overflow
+	if (num_workers < 1 || overflow_cap < 1 || stats_interval < 0 || (wal_path != NULL && policy_given && policy != POLICY_BLOCK)) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (wal_path != NULL) {
+		policy = POLICY_BLOCK;
+	}
 
 	//Configue and set signal handler for SIGINT
 	struct sigaction action;
@@ -42,27 +243,67 @@ int main()
 	action.sa_flags = 0;
 	sigaction(SIGINT, &action, NULL);
 
-	// Generate unique key for message queue
-	key = ftok("serverclient", 65);
-	if (key == -1) {
-		cout << "Error generating key: " << strerror(errno) << endl;
-		return -1;
-	}
-
-	// Create the message queue
-	msgid = msgget(key, 0666 | IPC_CREAT);
-	if (msgid == -1) {
+	// Create the server's inbox: the shared System V queue, or its own POSIX queue
+	if (msgOpenServer(transport, true, &inbox) == -1) {
 		cout << "Error creating message queue: " << strerror(errno) << endl;
 		return -1;
 	}
+	chunk_max = msgChunkMax(&inbox);
+	cout << "Server: " << (transport == TRANSPORT_POSIX ? "POSIX" : "System V") << " message queues, messages carry up to "
+		<< chunk_max << " payload bytes, longer ones are chunked" << endl;
 
-	// Initializes a mutex (lock)
-	if (pthread_mutex_init(&lock_x, NULL) != 0) {
+	// A client starts with a quarter of the shared queue, at most half
+	struct msqid_ds stat;
+	kernel_cap_min = MSG_HEADER_SIZE + chunk_max;
+	kernel_cap_max = transport == TRANSPORT_SYSV && msgctl(inbox.id, IPC_STAT, &stat) == 0 ? stat.msg_qbytes / 2 : 0;
+	kernel_cap_max = max(kernel_cap_min, kernel_cap_max);
+	kernel_cap = max(kernel_cap_min, kernel_cap_max / 2);
+
+	// Initializes a mutex (lock) and the condition main sleeps on
+	if (pthread_mutex_init(&lock_x, NULL) != 0 || pthread_cond_init(&receive_done, NULL) != 0) {
 		cout << "Error initializing mutex: " << strerror(errno) << endl;
 		return -1;
 	}
 
 	is_running = true;
+	receiving = true;
+
+	// SIGINT stays blocked in every thread but the System V receive thread, which
+	// unblocks it so Ctrl-C interrupts its blocking msgrcv(). The POSIX receive
+	// thread reads it from a signalfd instead.
+	sigset_t sigint;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+
+	WalState state;
+	if (wal_path != NULL && walOpen(&wal, wal_path, &state, acknowledge, NULL) == -1) {
+		cout << "Error opening the log " << wal_path << ": " << strerror(errno) << endl;
+		return -1;
+	}
+
+	workers = new Worker[num_workers];
+	for (int i = 0; i < num_workers; ++i) {
+		Worker* worker = &workers[i];
+		worker->receiving = true;
+		worker->dispatched = 0;
+		worker->scratch = (Message*)malloc(sizeof(Message));
+		worker->backlog = 0;
+		worker->dropped = 0;
+		worker->reclaimed = 0;
+		worker->worst_client = 0;
+		worker->worst_backlog = 0;
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->ready, NULL);
+		if (pthread_create(&worker->tid, NULL, dispatch_func, worker) != 0) {
+			cout << "Error creating dispatch thread: " << strerror(errno) << endl;
+			return -1;
+		}
+	}
+	cout << "Server: " << num_workers << " dispatch thread(s)" << endl;
+	if (wal_path != NULL) {
+		restore(&state);
+	}
 
 	// Creates a new thread that runs the function recv_func()
 	if (pthread_create(&tid_r, NULL, recv_func, NULL) != 0) {
@@ -71,44 +312,61 @@ int main()
 		return -1;
 	}
 
-	while (is_running) {
-		if (message.size() > 0) {
-			pthread_mutex_lock(&lock_x);
-			Message sendMsg = message.front();
-			message.pop();
-			pthread_mutex_unlock(&lock_x);
-
-			sendMsg.mtype = sendMsg.msgBuf.dest;
-			if (msgsnd(msgid, &sendMsg, sizeof(sendMsg), 0) == -1) {
-				cout << "Error sending message: " << strerror(errno) << endl;
-			}
-			else {
-				cout << "Server dispatched a message from client "
-					<< sendMsg.msgBuf.source << " to --> client "
-					<< sendMsg.msgBuf.dest << " : " << sendMsg.msgBuf.buf << endl;
-			}
+	// Wait for the receive thread to finish
+	uint64_t next_report = 0;
+	pthread_mutex_lock(&lock_x);
+	while (receiving) {
+		// System V: a second's wakeup lets the receive thread check for dead clients,
+		// and rescues it should SIGINT have arrived just before msgrcv() blocked
+		if (transport == TRANSPORT_SYSV) {
+			wakeReceiver();
 		}
-		else {
-			usleep(1000); // Sleep briefly to avoid busy-waiting
+		uint64_t now = monotonicMs();
+		sampleQueue(stats_interval > 0 && now >= next_report);
+		if (stats_interval > 0 && now >= next_report) {
+			next_report = now + stats_interval * 1000;
 		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		pthread_cond_timedwait(&receive_done, &lock_x, &deadline);
 	}
+	pthread_mutex_unlock(&lock_x);
 
-	// Send "Quit" messages to all clients on shutdown
-	Message quitMsg;
-	sprintf(quitMsg.msgBuf.buf, "Quit");
+	// Workers send what is still queued, then leave
+	long dispatched = 0;
+	long dropped = 0;
+	long reclaimed = 0;
+	for (int i = 0; i < num_workers; ++i) {
+		pthread_join(workers[i].tid, NULL);
+		dispatched += workers[i].dispatched;
+		dropped += workers[i].dropped;
+		reclaimed += workers[i].reclaimed;
+		free(workers[i].scratch);
+	}
+	cout << "Server dispatched " << dispatched << " message(s)";
+	if (dropped > 0 || reclaimed > 0) {
+		cout << ", dropped " << dropped << " and took back " << reclaimed << " queued for slow clients";
+	}
+	cout << endl;
+	if (wal_path != NULL) {
+		walClose(&wal);
+		cout << "Server: logged " << wal.records << " record(s), " << wal.bytes << " bytes in "
+			<< wal.groups << " group commit(s)" << endl;
+	}
 
-	for (int i = 0; i < 3; i++) {
-		quitMsg.mtype = i + 1;
-		quitMsg.msgBuf.source = 0;
-		quitMsg.msgBuf.dest = i + 1;
-		if (msgsnd(msgid, &quitMsg, sizeof(quitMsg), 0) == -1) {
-			cout << "Error sending Quit to client " << i + 1 << ": " << strerror(errno) << endl;
+	// Send "Quit" messages to all clients still registered on shutdown
+	for (map<long, ClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it) {
+		if (msgSendPayload(&it->second.endpoint, 0, it->first, "Quit", 4, chunk_max, IPC_NOWAIT) == -1) {
+			cout << "Error sending Quit to client " << it->first << ": " << strerror(errno) << endl;
 		}
-		else {
-			cout << "Server sent Quit message to client " << i + 1 << endl;
+		else if (!quiet) {
+			cout << "Server sent Quit message to client " << it->first << endl;
 		}
-
+		msgClose(&it->second.endpoint);
 	}
+	cout << "Server: " << next_id - 1 << " client(s) registered, "
+		<< clients.size() << " still there at shutdown" << endl;
 
 	// Wait for receive thread to exit
 	if (pthread_join(tid_r, NULL) != 0) {
@@ -117,31 +375,812 @@ int main()
 	}
 
 	cout << "Server: quitting ..." << endl;
-	msgctl(msgid, IPC_RMID, NULL);
+	msgRemove(&inbox);
+	msgClose(&inbox);
 	return 0;
 }
 
-void* recv_func(void* arg) {
+// Shrinks the share of the shared System V queue a client may fill while the
+// queue is more than half full, and grows it again below a quarter. Prints the
+// queue depth and the backlog when asked.
+void sampleQueue(bool report)
+{
+	ostringstream line;
+	if (transport == TRANSPORT_SYSV) {
+		struct msqid_ds stat;
+		if (msgctl(inbox.id, IPC_STAT, &stat) == -1) {
+			return;
+		}
+		size_t cap = kernel_cap;
+		if (stat.msg_cbytes * 2 > stat.msg_qbytes) {
+			cap = max(kernel_cap_min, cap / 2);
+		}
+		else if (stat.msg_cbytes * 4 < stat.msg_qbytes) {
+			cap = min(kernel_cap_max, cap * 2);
+		}
+		kernel_cap = cap;
+		line << "Server: queue " << stat.msg_qnum << " message(s), " << stat.msg_cbytes << " of "
+			<< stat.msg_qbytes << " bytes (" << stat.msg_cbytes * 100 / stat.msg_qbytes << "%), "
+			<< cap << " bytes per client";
+	}
+	else {
+		struct mq_attr attr;
+		if (mq_getattr(inbox.id, &attr) == -1) {
+			return;
+		}
+		line << "Server: inbox " << attr.mq_curmsgs << " of " << attr.mq_maxmsg << " message(s)";
+	}
+	if (!report) {
+		return;
+	}
+
+	long backlog = 0;
+	long dropped = 0;
+	long reclaimed = 0;
+	long worst_client = 0;
+	long worst_backlog = 0;
+	for (int i = 0; i < num_workers; ++i) {
+		backlog += workers[i].backlog;
+		dropped += workers[i].dropped;
+		reclaimed += workers[i].reclaimed;
+		if (workers[i].worst_backlog > worst_backlog) {
+			worst_backlog = workers[i].worst_backlog;
+			worst_client = workers[i].worst_client;
+		}
+	}
+	line << "; overflow " << backlog << " message(s)";
+	if (worst_backlog > 0) {
+		line << ", most for client " << worst_client << " (" << worst_backlog << ")";
+	}
+	line << "; " << dropped << " dropped, " << reclaimed << " taken back\n";
+	cout << line.str() << flush;
+}
+
+// Sends the server an empty message from source 0 so a blocked msgrcv() returns
+void wakeReceiver()
+{
+	msgSendPayload(&inbox, 0, 0, NULL, 0, chunk_max, IPC_NOWAIT);
+}
+
+// Queues a message for the worker that owns its destination
+static void dispatch(long client, const Endpoint* to, Message* msg, bool last = false, Tracked* tracked = NULL)
+{
+	if (tracked != NULL) {
+		tracked->copies++;
+	}
+	Delivery delivery = { client, *to, msg, last, tracked };
+	Worker* worker = &workers[(unsigned long)client % num_workers];
+	pthread_mutex_lock(&worker->lock);
+	bool was_empty = worker->message.empty();
+	worker->message.push(delivery);
+	pthread_mutex_unlock(&worker->lock);
+	// A worker with messages left is not waiting, no need to wake it
+	if (was_empty) {
+		pthread_cond_signal(&worker->ready);
+	}
+}
+
+// Queues a copy for a registered client
+static void deliver(map<long, ClientInfo>::iterator client, Message* msg, Tracked* tracked = NULL)
+{
+	if (msg == NULL) {
+		cout << "Out of memory, message dropped" << endl;
+		return;
+	}
+	dispatch(client->first, &client->second.endpoint, msg, false, tracked);
+}
+
+// Gives up a reference to a logged message; the last one notes it delivered
+static void release(Tracked* tracked, vector<uint64_t>* delivered)
+{
+	if (--tracked->copies == 0) {
+		delivered->push_back(tracked->seq);
+		delete tracked;
+	}
+}
+
+// Logs a client message (-d). Its sender hears once it is on disk, for a
+// payload in chunks once its last chunk is.
+static Tracked* track(const Message* msg)
+{
+	map<long, ClientInfo>::iterator sender = clients.find(msg->msgBuf.source);
+	WalAck ack;
+	bool acked = sender != clients.end() && !(msg->msgBuf.flags & CHUNK_MORE);
+	if (acked) {
+		ack.client = sender->first;
+		ack.to = sender->second.endpoint;
+		ack.count = 1;
+	}
+	Tracked* tracked = new Tracked;
+	tracked->seq = walAppend(&wal, WAL_MESSAGE, &msg->msgBuf, MSG_HEADER_SIZE + msg->msgBuf.len, acked ? &ack : NULL);
+	tracked->copies = 1;
+	return tracked;
+}
+
+// On the log's commit thread: count more of the client's messages are on disk.
+// The acknowledgement queues behind what the client's worker has for it.
+void acknowledge(long client, const Endpoint* to, long count, void* arg)
+{
+	Message* msg = msgAlloc(0, client, MSG_ACK, (const char*)&count, sizeof(count));
+	if (msg != NULL) {
+		dispatch(client, to, msg);
+	}
+}
+
+// A client leaves the table: first the acknowledgements still due to it are
+// queued, so they arrive ahead of whatever ends its endpoint
+static void forget(long id)
+{
+	if (wal_path != NULL) {
+		walSync(&wal);
+		walAppend(&wal, WAL_UNREGISTER, &id, sizeof(id));
+	}
+}
+
+// Tells a sender that the client it addressed is not registered
+static void bounce(long sender, long unknown)
+{
+	map<long, ClientInfo>::iterator it = clients.find(sender);
+	if (it != clients.end()) {
+		deliver(it, msgAlloc(unknown, sender, MSG_UNKNOWN, NULL, 0));
+	}
+}
+
+// Forgets clients whose process has gone without unregistering; their worker
+// removes what is left of their queue
+static void sweepClients()
+{
+	map<long, ClientInfo>::iterator it = clients.begin();
+	while (it != clients.end()) {
+		if (kill(it->second.pid, 0) == -1 && errno == ESRCH) {
+			cout << "Server: client " << it->first << " (pid " << it->second.pid << ") is gone" << endl;
+			forget(it->first);
+			dispatch(it->first, &it->second.endpoint, NULL, true);
+			clients.erase(it++);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+// Registration, on the receive thread
+static void handleControl(const MesgBuffer* buf)
+{
+	if (buf->flags & MSG_REGISTER) {
+		ClientInfo info;
+		info.sent = 0;
+		info.pid = 0;
+		if (buf->len >= sizeof(pid_t)) {
+			memcpy(&info.pid, buf->buf, sizeof(pid_t));
+		}
+		if (msgOpenClient(&inbox, buf->source, &info.endpoint) == -1) {
+			cout << "Error opening the queue of client token " << buf->source << ": " << strerror(errno) << endl;
+			return;
+		}
+		// The newcomer learns who is already there
+		vector<long> ids;
+		ids.reserve(clients.size());
+		for (map<long, ClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it) {
+			ids.push_back(it->first);
+		}
+		long id = next_id++;
+		if (msgSendPayload(&info.endpoint, 0, id, (const char*)ids.data(),
+				ids.size() * sizeof(long), chunk_max, 0, MSG_WELCOME) == -1) {
+			cout << "Error answering registration of pid " << info.pid << ": " << strerror(errno) << endl;
+			msgClose(&info.endpoint);
+			return;
+		}
+		msgAssignId(&info.endpoint, id);
+		clients[id] = info;
+		if (wal_path != NULL) {
+			WalClient logged = { id, buf->source, info.pid };
+			walAppend(&wal, WAL_REGISTER, &logged, sizeof(logged));
+		}
+		if (!quiet) {
+			cout << "Server registered client " << id << " (pid " << info.pid << "), "
+				<< clients.size() << " client(s)" << endl;
+		}
+	}
+	else if (buf->flags & MSG_UNREGISTER) {
+		map<long, ClientInfo>::iterator it = clients.find(buf->source);
+		if (it == clients.end()) {
+			return;
+		}
+		// Through the client's worker, so it follows whatever is still queued for it
+		forget(it->first);
+		dispatch(it->first, &it->second.endpoint, msgAlloc(0, it->first, 0, "Quit", 4), true);
+		clients.erase(it);
+		if (!quiet) {
+			cout << "Server unregistered client " << buf->source << ", " << clients.size() << " client(s)" << endl;
+		}
+	}
+}
+
+// Hands a client message to the workers of its destinations, on the receive thread
+static void route(const Message* msg, Tracked* tracked)
+{
+	const MesgBuffer* buf = &msg->msgBuf;
+	map<long, ClientInfo>::iterator sender = clients.find(buf->source);
+	if (sender != clients.end()) {
+		sender->second.sent++;
+	}
+
+	if (buf->dest == DEST_BROADCAST) {
+		for (map<long, ClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it) {
+			if (it->first != buf->source) {
+				deliver(it, msgCopy(msg), tracked);
+			}
+		}
+	}
+	else if (buf->dest == DEST_FANOUT) {
+		// The list is repeated in every chunk and stripped before delivery
+		const long* ids;
+		const char* body;
+		size_t len;
+		int count = msgFanoutList(buf, &ids, &body, &len);
+		if (count < 0) {
+			cout << "Dropped a malformed fan-out message from client " << buf->source << endl;
+			return;
+		}
+		for (int i = 0; i < count; ++i) {
+			map<long, ClientInfo>::iterator it = clients.find(ids[i]);
+			if (it == clients.end()) {
+				if (!(buf->flags & CHUNK_MORE)) {
+					bounce(buf->source, ids[i]);
+				}
+				continue;
+			}
+			deliver(it, msgAlloc(buf->source, DEST_FANOUT, buf->flags, body, len), tracked);
+		}
+	}
+	else {
+		map<long, ClientInfo>::iterator it = clients.find(buf->dest);
+		if (it != clients.end()) {
+			deliver(it, msgCopy(msg), tracked);
+		}
+		else if (!(buf->flags & CHUNK_MORE)) {
+			// Nobody would ever read it; dropping keeps the queue from filling up
+			bounce(buf->source, buf->dest);
+		}
+	}
+}
+
+// Everything that reaches the inbox, on the receive thread
+static void handleMessage(const Message* msg)
+{
+	if (msg->msgBuf.source == 0) { // Wakeup from main
+		sweepClients();
+		return;
+	}
+	if (msg->msgBuf.dest == DEST_SERVER) {
+		handleControl(&msg->msgBuf);
+		return;
+	}
+	if (!quiet) {
+		cout << "Server received a message from client " << msg->msgBuf.source
+			<< " to --> client " << msg->msgBuf.dest << " : " << msgPreview(msg->msgBuf.buf, msg->msgBuf.len) << endl;
+	}
+	if (wal_path == NULL) {
+		route(msg, NULL);
+		return;
+	}
+	// Logged before any copy can leave; a message nobody gets is done at once
+	Tracked* tracked = track(msg);
+	route(msg, tracked);
+	vector<uint64_t> delivered;
+	release(tracked, &delivered);
+	walDelivered(&wal, delivered.data(), delivered.size());
+}
+
+// Takes back the clients and the undelivered messages of the log after a
+// restart (-d). Clients still alive go on with their ids; the others are
+// swept like any client that died.
+void restore(WalState* state)
+{
+	next_id = state->next_id;
+	for (map<long, WalClient>::iterator it = state->clients.begin(); it != state->clients.end(); ++it) {
+		ClientInfo info;
+		info.pid = it->second.pid;
+		info.sent = 0;
+		if (msgOpenClient(&inbox, it->second.token, &info.endpoint) == -1) {
+			cout << "Server: client " << it->first << " did not come back: " << strerror(errno) << endl;
+			walAppend(&wal, WAL_UNREGISTER, &it->first, sizeof(it->first));
+			continue;
+		}
+		msgAssignId(&info.endpoint, it->first);
+		clients[it->first] = info;
+	}
+	vector<uint64_t> delivered;
+	for (map<uint64_t, Message*>::iterator it = state->undelivered.begin(); it != state->undelivered.end(); ++it) {
+		Tracked* tracked = new Tracked;
+		tracked->seq = it->first;
+		tracked->copies = 1;
+		route(it->second, tracked);
+		release(tracked, &delivered);
+		free(it->second);
+	}
+	walDelivered(&wal, delivered.data(), delivered.size());
+	cout << "Server: restored " << clients.size() << " client(s) and " << state->undelivered.size()
+		<< " undelivered message(s) from " << wal_path << endl;
+}
+
+// System V: block in msgrcv() until a client sends
+static void receiveSysv(MsgReader* reader, Message* msg)
+{
+	sigset_t sigint;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_UNBLOCK, &sigint, NULL);
+
 	while (is_running) {
-		Message msg;
-		// Use IPC_NOWAIT with msgrcv to make it non-blocking, allowing the loop to check is_running regularly.
-		if (msgrcv(msgid, &msg, sizeof(msg), 4, IPC_NOWAIT) == -1) {
-			if (errno == ENOMSG) { // No message available
-				usleep(1000); // Brief sleep to avoid busy-waiting
+		// SIGINT interrupts msgrcv() with EINTR (never restarted)
+		if (msgRead(&inbox, reader, msg, 0) == -1) {
+			if (errno == EINTR) { // Signal: the loop condition decides
 				continue;
 			}
-			if (errno == EINTR || errno == EIDRM) { // Signal or queue removed
-				break;
+			if (errno == EBADMSG) { // Length field does not match, drop it
+				cout << "Dropped a malformed message" << endl;
+				continue;
 			}
-			cout << "Error receiving message: " << strerror(errno) << endl;
-			continue;
+			if (errno != EIDRM) { // Anything but the queue being removed
+				cout << "Error receiving message: " << strerror(errno) << endl;
+			}
+			break;
 		}
-		pthread_mutex_lock(&lock_x);
-		message.push(msg);
-		cout << "Server received a message from client " << msg.msgBuf.source
-			<< " to --> client " << msg.msgBuf.dest << " : " << msg.msgBuf.buf << endl;
-		pthread_mutex_unlock(&lock_x);
+		handleMessage(msg);
+	}
+}
+
+// POSIX: the inbox descriptor, SIGINT and a one-second housekeeping timer
+// share one epoll loop
+static void receivePosix(MsgReader* reader, Message* msg)
+{
+	int epfd = epoll_create1(0);
+	sigset_t sigint;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	int sigfd = signalfd(-1, &sigint, SFD_NONBLOCK);
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epfd == -1 || sigfd == -1 || timerfd == -1) {
+		cout << "Error setting up the event loop: " << strerror(errno) << endl;
+		return;
+	}
+	struct itimerspec every_second;
+	memset(&every_second, 0, sizeof(every_second));
+	every_second.it_value.tv_sec = 1;
+	every_second.it_interval.tv_sec = 1;
+	timerfd_settime(timerfd, 0, &every_second, NULL);
+
+	int fds[3] = { inbox.id, sigfd, timerfd };
+	for (int i = 0; i < 3; ++i) {
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = fds[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event);
+	}
+
+	while (is_running) {
+		struct epoll_event events[3];
+		int count = epoll_wait(epfd, events, 3, -1);
+		if (count == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cout << "Error waiting for events: " << strerror(errno) << endl;
+			break;
+		}
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == inbox.id) {
+				// Everything queued, urgent messages first
+				while (true) {
+					if (msgRead(&inbox, reader, msg, IPC_NOWAIT) == -1) {
+						if (errno == EBADMSG) {
+							cout << "Dropped a malformed message" << endl;
+							continue;
+						}
+						if (errno != EAGAIN) {
+							cout << "Error receiving message: " << strerror(errno) << endl;
+						}
+						break;
+					}
+					handleMessage(msg);
+				}
+			}
+			else if (fd == sigfd) {
+				struct signalfd_siginfo info;
+				if (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+					cout << "\nCrtl + C Shutting Down" << endl;
+					is_running = false;
+				}
+			}
+			else {
+				uint64_t expirations;
+				if (read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					sweepClients();
+				}
+			}
+		}
+	}
+	close(timerfd);
+	close(sigfd);
+	close(epfd);
+}
+
+void* recv_func(void* arg) {
+	// Large enough for any message; each one is copied out at its real size.
+	// Batches from clients are taken apart here and repacked per destination.
+	Message* msg = (Message*)malloc(sizeof(Message));
+	MsgReader reader;
+	if (msgReaderInit(&reader) == -1 || msg == NULL) {
+		cout << "Out of memory" << endl;
+		is_running = false;
+	}
+	else if (transport == TRANSPORT_POSIX) {
+		receivePosix(&reader, msg);
+	}
+	else {
+		receiveSysv(&reader, msg);
+	}
+	msgReaderFree(&reader);
+	free(msg);
+
+	// Acknowledgements still due go out before the workers stop
+	if (wal_path != NULL) {
+		walSync(&wal);
+	}
+
+	// Let the workers finish what is queued and leave
+	for (int i = 0; i < num_workers; ++i) {
+		pthread_mutex_lock(&workers[i].lock);
+		workers[i].receiving = false;
+		pthread_cond_signal(&workers[i].ready);
+		pthread_mutex_unlock(&workers[i].lock);
 	}
+	pthread_mutex_lock(&lock_x);
+	receiving = false;
+	pthread_cond_signal(&receive_done);
+	pthread_mutex_unlock(&lock_x);
 	cout << "recv_func exiting" << endl; // Debug to confirm exit
 	pthread_exit(NULL);
 }
+
+// System V: whether size more bytes would take the client past its share of
+// the shared queue. A client with nothing there may always send.
+static bool kernelFull(const Destination* dest, size_t size)
+{
+	return transport == TRANSPORT_SYSV && dest->in_kernel > 0
+		&& dest->in_kernel + size > kernel_cap.load(memory_order_relaxed);
+}
+
+// Under POLICY_DROP the oldest messages make way beyond overflow_cap
+static void trimOverflow(Destination* dest)
+{
+	while (policy == POLICY_DROP && dest->overflow_bytes > overflow_cap) {
+		dest->overflow_bytes -= MSG_HEADER_SIZE + dest->overflow.front()->msgBuf.len;
+		free(dest->overflow.front());
+		dest->overflow.pop_front();
+		dest->worker->backlog--;
+		dest->worker->dropped++;
+	}
+}
+
+static void backUp(Destination* dest)
+{
+	if (dest->worker->backed_up.insert(dest->id).second) {
+		dest->backoff_us = RETRY_MIN_US;
+		dest->retry_us = monotonicUs() + RETRY_MIN_US;
+	}
+}
+
+// System V: takes back what the client has not read yet. It goes in front of
+// the overflow, so the client still gets everything in order.
+static void reclaim(Destination* dest)
+{
+	Worker* worker = dest->worker;
+	vector<Message*> unread;
+	while (true) {
+		if (msgReceive(&dest->to, worker->scratch, IPC_NOWAIT) == -1) {
+			if (errno == EBADMSG) {
+				continue;
+			}
+			break;
+		}
+		Message* copy = msgCopy(worker->scratch);
+		if (copy == NULL) {
+			worker->dropped++;
+			continue;
+		}
+		dest->overflow_bytes += MSG_HEADER_SIZE + copy->msgBuf.len;
+		unread.push_back(copy);
+	}
+	dest->in_kernel = 0;
+	if (unread.empty()) {
+		return;
+	}
+	dest->overflow.insert(dest->overflow.begin(), unread.begin(), unread.end());
+	worker->backlog += unread.size();
+	worker->reclaimed += unread.size();
+	backUp(dest);
+	trimOverflow(dest);
+}
+
+// Sends from the overflow while there is room. Returns how many went.
+static size_t sendOverflow(Destination* dest)
+{
+	size_t sent = 0;
+	while (!dest->overflow.empty()) {
+		Message* msg = dest->overflow.front();
+		size_t size = MSG_HEADER_SIZE + msg->msgBuf.len;
+		if (kernelFull(dest, size)) {
+			break;
+		}
+		if (msgForward(&dest->to, msg, IPC_NOWAIT) == -1) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			cout << "Error sending message: " << strerror(errno) << endl;
+			dest->worker->dropped++;
+		}
+		else {
+			dest->in_kernel += size;
+			sent++;
+		}
+		dest->overflow_bytes -= size;
+		free(msg);
+		dest->overflow.pop_front();
+		dest->worker->backlog--;
+	}
+	return sent;
+}
+
+// Everything for a client leaves through here, batched or not: sent at once
+// if the client has room, otherwise kept in its overflow
+static int sendKernel(Message* msg, void* arg)
+{
+	Destination* dest = (Destination*)arg;
+	if (policy == POLICY_BLOCK) {
+		return msgForward(&dest->to, msg, 0);
+	}
+	size_t size = MSG_HEADER_SIZE + msg->msgBuf.len;
+	if (dest->overflow.empty() && kernelFull(dest, size)) {
+		// A client that keeps up has read most of it; what it has not goes again
+		reclaim(dest);
+		sendOverflow(dest);
+	}
+	if (dest->overflow.empty() && !kernelFull(dest, size)) {
+		if (msgForward(&dest->to, msg, IPC_NOWAIT) == 0) {
+			dest->in_kernel += size;
+			return 0;
+		}
+		if (errno != EAGAIN) {
+			return -1;
+		}
+	}
+	Message* copy = msgCopy(msg);
+	if (copy == NULL) {
+		return -1;
+	}
+	dest->overflow.push_back(copy);
+	dest->overflow_bytes += size;
+	dest->worker->backlog++;
+	backUp(dest);
+	trimOverflow(dest);
+	return 0;
+}
+
+static Destination* destinationFor(Worker* worker, const Delivery* delivery)
+{
+	map<long, Destination*>::iterator it = worker->destinations.find(delivery->client);
+	if (it != worker->destinations.end()) {
+		return it->second;
+	}
+	Destination* dest = new Destination;
+	dest->id = delivery->client;
+	dest->to = delivery->to;
+	dest->worker = worker;
+	dest->overflow_bytes = 0;
+	dest->in_kernel = 0;
+	dest->retry_us = 0;
+	dest->backoff_us = RETRY_MIN_US;
+	dest->closing = false;
+	dest->batched = batching && msgBatchInit(&dest->batch, &delivery->to, 0, delivery->client, chunk_max, 0) == 0;
+	if (dest->batched) {
+		msgBatchSender(&dest->batch, sendKernel, dest);
+	}
+	worker->destinations[dest->id] = dest;
+	return dest;
+}
+
+// Forgets a client; what is still in its overflow is dropped
+static void freeDestination(Destination* dest, bool close)
+{
+	Worker* worker = dest->worker;
+	for (size_t i = 0; i < dest->overflow.size(); ++i) {
+		free(dest->overflow[i]);
+	}
+	worker->backlog -= dest->overflow.size();
+	worker->dropped += dest->overflow.size();
+	if (dest->batched) {
+		msgBatchFree(&dest->batch);
+	}
+	if (close) {
+		msgClose(&dest->to);
+	}
+	worker->backed_up.erase(dest->id);
+	worker->destinations.erase(dest->id);
+	delete dest;
+}
+
+// Sends a message to its client, through the client's batch when batching
+static int sendDelivery(Destination* dest, Message* msg, vector<long>* pending)
+{
+	if (!dest->batched) {
+		return sendKernel(msg, dest);
+	}
+	if (dest->batch.count == 0) {
+		pending->push_back(dest->id);
+	}
+	return msgBatchAdd(&dest->batch, msg, 0);
+}
+
+// Tries the overflows that are due. A client that read nothing since the last
+// try is left alone for twice as long, up to RETRY_MAX_US. Returns when the
+// next one is due.
+static uint64_t retryOverflows(Worker* worker)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t now = monotonicUs();
+	long worst_client = 0;
+	long worst_backlog = 0;
+	set<long>::iterator it = worker->backed_up.begin();
+	while (it != worker->backed_up.end()) {
+		Destination* dest = worker->destinations[*it++];
+		if (dest->retry_us <= now) {
+			size_t before = dest->overflow.size();
+			if (!dest->overflow.empty() && kernelFull(dest, MSG_HEADER_SIZE + dest->overflow.front()->msgBuf.len)) {
+				reclaim(dest);
+			}
+			sendOverflow(dest);
+			if (dest->overflow.empty()) {
+				worker->backed_up.erase(dest->id);
+				if (dest->closing) {
+					freeDestination(dest, true);
+				}
+				continue;
+			}
+			bool progress = dest->overflow.size() < before;
+			dest->backoff_us = progress ? RETRY_MIN_US : min<uint64_t>(dest->backoff_us * 2, RETRY_MAX_US);
+			dest->retry_us = now + dest->backoff_us;
+		}
+		next = min(next, dest->retry_us);
+		if ((long)dest->overflow.size() > worst_backlog) {
+			worst_backlog = dest->overflow.size();
+			worst_client = dest->id;
+		}
+	}
+	worker->worst_client = worst_client;
+	worker->worst_backlog = worst_backlog;
+	return next;
+}
+
+void* dispatch_func(void* arg) {
+	Worker* worker = (Worker*)arg;
+	vector<long> pending;   // Clients with something batched
+	vector<Tracked*> sent;  // -d: copies of logged messages handled this round
+	vector<uint64_t> delivered;
+	uint64_t next_retry = 0;
+	uint64_t give_up_ms = 0;
+
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		while (worker->message.empty()) {
+			if (!worker->backed_up.empty()) {
+				// Come back for the overflows
+				uint64_t now = monotonicUs();
+				if (next_retry > now) {
+					uint64_t wait = next_retry - now;
+					struct timespec deadline;
+					clock_gettime(CLOCK_REALTIME, &deadline);
+					deadline.tv_sec += wait / 1000000;
+					deadline.tv_nsec += (wait % 1000000) * 1000;
+					if (deadline.tv_nsec >= 1000000000L) {
+						deadline.tv_sec++;
+						deadline.tv_nsec -= 1000000000L;
+					}
+					pthread_cond_timedwait(&worker->ready, &worker->lock, &deadline);
+				}
+				break;
+			}
+			if (!worker->receiving) {
+				break;
+			}
+			pthread_cond_wait(&worker->ready, &worker->lock);
+		}
+		if (worker->message.empty() && !worker->receiving) {
+			// Overflows get a last chance to go out
+			if (give_up_ms == 0) {
+				give_up_ms = monotonicMs() + SHUTDOWN_DRAIN_MS;
+			}
+			if (worker->backed_up.empty() || monotonicMs() >= give_up_ms) {
+				break;
+			}
+		}
+		// Take everything queued so far and send it without holding the lock
+		queue<Delivery> batch;
+		batch.swap(worker->message);
+		pthread_mutex_unlock(&worker->lock);
+
+		while (!batch.empty()) {
+			Delivery* delivery = &batch.front();
+			Message* sendMsg = delivery->msg;
+			Destination* dest = destinationFor(worker, delivery);
+			if (sendMsg == NULL) {
+				// The client died: nobody will read what is left for it
+				msgRemove(&delivery->to);
+				freeDestination(dest, delivery->last);
+				dest = NULL;
+			}
+			// Chunks are relayed one by one; the destination joins them
+			else if (sendDelivery(dest, sendMsg, &pending) == -1) {
+				cout << "Error sending message: " << strerror(errno) << endl;
+			}
+			else {
+				worker->dispatched++;
+				if (!quiet) {
+					// One write per line keeps lines of different workers apart
+					ostringstream line;
+					line << "Server dispatched a message from client "
+						<< sendMsg->msgBuf.source << " to --> client "
+						<< delivery->client << " : " << msgPreview(sendMsg->msgBuf.buf, sendMsg->msgBuf.len) << "\n";
+					cout << line.str() << flush;
+				}
+			}
+			if (dest != NULL && delivery->last) {
+				// The endpoint closes once the overflow is out
+				if (dest->batched && msgBatchFlush(&dest->batch, 0) == -1) {
+					cout << "Error sending message: " << strerror(errno) << endl;
+				}
+				if (dest->overflow.empty()) {
+					freeDestination(dest, true);
+				}
+				else {
+					dest->closing = true;
+				}
+			}
+			if (delivery->tracked != NULL) {
+				sent.push_back(delivery->tracked);
+			}
+			free(sendMsg);
+			batch.pop();
+		}
+		// Whatever queued up while the last round was sent leaves together, so a
+		// busy worker packs many messages per send and an idle one adds no delay
+		for (size_t i = 0; i < pending.size(); ++i) {
+			map<long, Destination*>::iterator it = worker->destinations.find(pending[i]);
+			if (it != worker->destinations.end() && msgBatchFlush(&it->second->batch, 0) == -1) {
+				cout << "Error sending message: " << strerror(errno) << endl;
+			}
+		}
+		pending.clear();
+		// Flushed and -p block: every copy of the round is in its client's queue
+		for (size_t i = 0; i < sent.size(); ++i) {
+			release(sent[i], &delivered);
+		}
+		sent.clear();
+		if (!delivered.empty()) {
+			walDelivered(&wal, delivered.data(), delivered.size());
+			delivered.clear();
+		}
+		next_retry = retryOverflows(worker);
+		pthread_mutex_lock(&worker->lock);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	// Main closes the endpoints of the clients still registered
+	while (!worker->destinations.empty()) {
+		Destination* dest = worker->destinations.begin()->second;
+		freeDestination(dest, dest->closing);
+	}
+	pthread_exit(NULL);
+}
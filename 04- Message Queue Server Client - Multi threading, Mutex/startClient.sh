@@ -1,5 +1,10 @@
-./client1 &
-sleep 0.7
-./client2 &
-sleep 0.7
-./client3 &
+# Usage: ./startClient.sh [count] [sysv|posix]
+# Starts count clients (default 3); every client registers and gets its id from the server.
+# The transport must be the one the server was started with (default sysv).
+count=${1:-3}
+transport=${2:-sysv}
+for i in $(seq 1 $count); do
+    ./client$(( (i - 1) % 3 + 1 )) -t $transport &
+    # The first three are staggered so the registration order is easy to follow
+    if [ $i -lt 3 ]; then sleep 0.7; fi
+done
@@ -0,0 +1,290 @@
+// wal.cpp - Write-ahead log of the durable relay (server -d)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include "wal.h"
+
+using namespace std;
+
+// Every record starts with this, its data follows padded to 8 bytes
+struct WalHeader {
+	uint32_t type;
+	uint32_t len;
+	uint64_t seq;
+	uint32_t check;   // Of the header, with check 0, and the data
+	uint32_t pad;
+};
+
+static size_t walPadded(size_t len)
+{
+	return (len + 7) & ~(size_t)7;
+}
+
+// FNV-1a: enough to tell a record cut short by a crash from a complete one
+static uint32_t walCheck(uint32_t hash, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void walRecord(string* out, WalType type, uint64_t seq, const void* data, size_t len)
+{
+	WalHeader header;
+	memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.len = len;
+	header.seq = seq;
+	header.check = walCheck(walCheck(2166136261u, &header, sizeof(header)), data, len);
+	out->append((const char*)&header, sizeof(header));
+	out->append((const char*)data, len);
+	out->append(walPadded(len) - len, '\0');
+}
+
+static int writeAll(int fd, const char* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, data, len);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// Builds the state from the records, up to the first damaged one
+static void walReplay(const string& log, WalState* state, uint64_t* next_seq)
+{
+	size_t offset = 0;
+	while (offset + sizeof(WalHeader) <= log.size()) {
+		WalHeader header;
+		memcpy(&header, log.data() + offset, sizeof(header));
+		const char* data = log.data() + offset + sizeof(header);
+		if (walPadded(header.len) > log.size() - offset - sizeof(header)) {
+			break;
+		}
+		uint32_t check = header.check;
+		header.check = 0;
+		if (walCheck(walCheck(2166136261u, &header, sizeof(header)), data, header.len) != check) {
+			break;
+		}
+		offset += sizeof(header) + walPadded(header.len);
+		*next_seq = max(*next_seq, header.seq + 1);
+
+		if (header.type == WAL_REGISTER && header.len == sizeof(WalClient)) {
+			WalClient client;
+			memcpy(&client, data, sizeof(client));
+			state->clients[client.id] = client;
+			state->next_id = max(state->next_id, client.id + 1);
+		}
+		else if (header.type == WAL_NEXT_ID && header.len == sizeof(long)) {
+			long id;
+			memcpy(&id, data, sizeof(id));
+			state->next_id = max(state->next_id, id);
+		}
+		else if (header.type == WAL_UNREGISTER && header.len == sizeof(long)) {
+			long id;
+			memcpy(&id, data, sizeof(id));
+			state->clients.erase(id);
+		}
+		else if (header.type == WAL_MESSAGE && header.len >= MSG_HEADER_SIZE) {
+			const MesgBuffer* buf = (const MesgBuffer*)data;
+			if (MSG_HEADER_SIZE + buf->len == header.len) {
+				Message* msg = msgAlloc(buf->source, buf->dest, buf->flags, buf->buf, buf->len);
+				if (msg != NULL) {
+					state->undelivered[header.seq] = msg;
+				}
+			}
+		}
+		else if (header.type == WAL_DELIVERED) {
+			for (size_t i = 0; i + sizeof(uint64_t) <= header.len; i += sizeof(uint64_t)) {
+				uint64_t seq;
+				memcpy(&seq, data + i, sizeof(seq));
+				map<uint64_t, Message*>::iterator it = state->undelivered.find(seq);
+				if (it != state->undelivered.end()) {
+					free(it->second);
+					state->undelivered.erase(it);
+				}
+			}
+		}
+	}
+	if (offset < log.size()) {
+		cout << "Server: log damaged after " << offset << " bytes, the rest is ignored" << endl;
+	}
+}
+
+static void* walThread(void* arg)
+{
+	Wal* wal = (Wal*)arg;
+	string writing;
+	vector<WalAck> acks;
+
+	pthread_mutex_lock(&wal->lock);
+	while (true) {
+		while (wal->buffer.empty() && !wal->closing) {
+			pthread_cond_wait(&wal->appended, &wal->lock);
+		}
+		if (wal->buffer.empty()) {
+			break;
+		}
+		// Everything appended while the last group was flushed makes the next one
+		writing.swap(wal->buffer);
+		acks.swap(wal->acks);
+		uint64_t records = wal->records;
+		pthread_mutex_unlock(&wal->lock);
+
+		bool safe = writeAll(wal->fd, writing.data(), writing.size()) == 0 && fdatasync(wal->fd) == 0;
+		if (!safe) {
+			cout << "Error writing the log: " << strerror(errno) << endl;
+		}
+		else {
+			for (size_t i = 0; i < acks.size(); ++i) {
+				wal->on_commit(acks[i].client, &acks[i].to, acks[i].count, wal->arg);
+			}
+		}
+		wal->groups++;
+		wal->bytes += writing.size();
+		writing.clear();
+		acks.clear();
+
+		pthread_mutex_lock(&wal->lock);
+		wal->synced = records;
+		pthread_cond_broadcast(&wal->committed);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	pthread_exit(NULL);
+}
+
+int walOpen(Wal* wal, const char* path, WalState* state, WalCommitted on_commit, void* arg)
+{
+	state->next_id = 1;
+	uint64_t next_seq = 1;
+
+	int fd = open(path, O_RDONLY);
+	if (fd != -1) {
+		string log;
+		char chunk[65536];
+		ssize_t len;
+		while ((len = read(fd, chunk, sizeof(chunk))) > 0) {
+			log.append(chunk, len);
+		}
+		close(fd);
+		walReplay(log, state, &next_seq);
+	}
+	else if (errno != ENOENT) {
+		return -1;
+	}
+
+	// The rewritten log holds the state and nothing else; rename() swaps it in whole
+	string compact;
+	walRecord(&compact, WAL_NEXT_ID, 0, &state->next_id, sizeof(state->next_id));
+	for (map<long, WalClient>::iterator it = state->clients.begin(); it != state->clients.end(); ++it) {
+		walRecord(&compact, WAL_REGISTER, 0, &it->second, sizeof(WalClient));
+	}
+	for (map<uint64_t, Message*>::iterator it = state->undelivered.begin(); it != state->undelivered.end(); ++it) {
+		walRecord(&compact, WAL_MESSAGE, it->first, &it->second->msgBuf, MSG_HEADER_SIZE + it->second->msgBuf.len);
+	}
+	string temp = string(path) + ".new";
+	fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+	if (writeAll(fd, compact.data(), compact.size()) == -1 || fsync(fd) == -1 || rename(temp.c_str(), path) == -1) {
+		int saved = errno;
+		close(fd);
+		unlink(temp.c_str());
+		errno = saved;
+		return -1;
+	}
+	// fd now refers to the log at path, positioned at its end
+	string dir = path;
+	size_t slash = dir.rfind('/');
+	dir = slash == string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+	int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dirfd != -1) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	wal->fd = fd;
+	wal->next_seq = next_seq;
+	wal->records = 0;
+	wal->synced = 0;
+	wal->closing = false;
+	wal->on_commit = on_commit;
+	wal->arg = arg;
+	wal->groups = 0;
+	wal->bytes = 0;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->appended, NULL);
+	pthread_cond_init(&wal->committed, NULL);
+	if (pthread_create(&wal->tid, NULL, walThread, wal) != 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t walAppend(Wal* wal, WalType type, const void* data, size_t len, const WalAck* ack)
+{
+	pthread_mutex_lock(&wal->lock);
+	uint64_t seq = wal->next_seq++;
+	bool was_empty = wal->buffer.empty();
+	walRecord(&wal->buffer, type, seq, data, len);
+	wal->records++;
+	if (ack != NULL) {
+		if (!wal->acks.empty() && wal->acks.back().client == ack->client) {
+			wal->acks.back().count += ack->count;
+		}
+		else {
+			wal->acks.push_back(*ack);
+		}
+	}
+	// The commit thread only waits while nothing is buffered
+	if (was_empty) {
+		pthread_cond_signal(&wal->appended);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return seq;
+}
+
+void walDelivered(Wal* wal, const uint64_t* seqs, size_t count)
+{
+	if (count > 0) {
+		walAppend(wal, WAL_DELIVERED, seqs, count * sizeof(uint64_t));
+	}
+}
+
+void walSync(Wal* wal)
+{
+	pthread_mutex_lock(&wal->lock);
+	uint64_t target = wal->records;
+	while (wal->synced < target) {
+		pthread_cond_wait(&wal->committed, &wal->lock);
+	}
+	pthread_mutex_unlock(&wal->lock);
+}
+
+void walClose(Wal* wal)
+{
+	pthread_mutex_lock(&wal->lock);
+	wal->closing = true;
+	pthread_cond_signal(&wal->appended);
+	pthread_mutex_unlock(&wal->lock);
+	pthread_join(wal->tid, NULL);
+	close(wal->fd);
+	pthread_mutex_destroy(&wal->lock);
+	pthread_cond_destroy(&wal->appended);
+	pthread_cond_destroy(&wal->committed);
+}
@@ -0,0 +1,90 @@
+// wal.h - Write-ahead log of the durable relay (server -d)
+//
+// The server appends what it accepts: registrations, client messages, and
+// which messages every recipient's queue has taken. A commit thread writes
+// whatever was appended while it was busy with one write() and one
+// fdatasync(), so a group of records costs one disk flush, and then tells the
+// server whose messages are now safe.
+//
+// On start the log is read up to its first damaged record, reduced to the
+// clients still registered and the messages not delivered yet, and rewritten.
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "msgio.h"
+
+enum WalType {
+	WAL_REGISTER = 1,     // WalClient
+	WAL_UNREGISTER = 2,   // The client id
+	WAL_MESSAGE = 3,      // MesgBuffer header and used payload
+	WAL_DELIVERED = 4,    // Sequence numbers of messages every recipient's queue took
+	WAL_NEXT_ID = 5       // The next client id, so a rewritten log does not reuse ids
+};
+
+// A registration as logged
+struct WalClient {
+	long  id;
+	long  token;   // The client's queue, see msgOpenClient()
+	pid_t pid;
+};
+
+// What the log held at start
+struct WalState {
+	std::map<long, WalClient>      clients;       // By id
+	std::map<uint64_t, Message*>   undelivered;   // By sequence number; release with free()
+	long                           next_id;       // Past every id ever assigned
+};
+
+// Called on the commit thread once a group is on disk, for every run of
+// messages from one sender in it, in order
+typedef void (*WalCommitted)(long client, const Endpoint* to, long count, void* arg);
+
+struct WalAck {
+	long     client;
+	Endpoint to;
+	long     count;
+};
+
+struct Wal {
+	int             fd;
+	pthread_t       tid;
+	pthread_mutex_t lock;
+	pthread_cond_t  appended;    // Something to write, or closing
+	pthread_cond_t  committed;   // A group is on disk
+	std::string     buffer;      // Records not written yet
+	std::vector<WalAck> acks;    // Senders of the messages in buffer
+	uint64_t        next_seq;
+	uint64_t        records;     // Appended so far
+	uint64_t        synced;      // Of which on disk
+	bool            closing;
+	WalCommitted    on_commit;
+	void*           arg;
+	// Commit thread only, read after walClose()
+	uint64_t        groups;
+	uint64_t        bytes;
+};
+
+// Reads and rewrites the log at path, creating it if needed, fills state and
+// starts the commit thread. Returns 0, or -1 with errno set.
+int walOpen(Wal* wal, const char* path, WalState* state, WalCommitted on_commit, void* arg);
+
+// Appends a record and returns its sequence number. A message with a sender
+// (ack not NULL) is reported through on_commit once it is on disk.
+uint64_t walAppend(Wal* wal, WalType type, const void* data, size_t len, const WalAck* ack = NULL);
+
+// Logs that the messages seqs[0..count) are delivered
+void walDelivered(Wal* wal, const uint64_t* seqs, size_t count);
+
+// Waits until everything appended so far is on disk and reported
+void walSync(Wal* wal);
+
+// Commits the rest and stops the commit thread
+void walClose(Wal* wal);
+
+#endif//WAL_H
@@ -1,132 +1,462 @@
-#include <stdio.h>      
-#include <stdlib.h>     // For exit()
-#include <unistd.h>     // For fork(), pipe(), execlp(), dup2(), close(), waitpid()
-#include <sys/types.h>  // For pid_t 
+#define _GNU_SOURCE     // For pipe2(), splice(), tee()
+#include <stdio.h>
+#include <stdlib.h>     // For exit(), malloc(), realloc()
+#include <unistd.h>     // For fork(), pipe2(), execvp(), dup2(), close()
+#include <sys/types.h>  // For pid_t
 #include <sys/wait.h>   // For waitpid()
-#include <string.h>     // For strcpy(), strtok()
+#include <string.h>     // For strdup(), strtok()
 #include <errno.h>      // For perror()
+#include <signal.h>     // For SIGPIPE
+#include <fcntl.h>      // For open(), splice(), tee()
+#include <pthread.h>    // For the relay threads
+#include <time.h>       // For clock_gettime()
 
-#define LEN 32
+#define RELAY_CHUNK 65536   // Bytes one splice() or tee() may move, a default pipe's size
 
+// One command of the pipeline
+struct stage {
+    char** args;    // NULL-terminated, for execvp()
+    int argc;
+    pid_t pid;      // 0 until forked
+    int status;     // From waitpid()
+    int copyOf;     // Side consumer of this edge, 0 for a stage of the pipeline
+};
 
-int main(int argc, char* argv[]) {
+// Moves an edge's stream from the stage before it to the one after it inside
+// the kernel, optionally duplicating it to a file or a side consumer's pipe
+struct relay {
+    int edge;               // Between stage edge and edge + 1; 0 if the edge is a plain pipe
+    int in;                 // Read end, the upstream stage writes the other one
+    int out;                // Write end, the downstream stage reads the other one; -1 once it left
+    int copy;               // File or side consumer's pipe; -1 for none or once it failed
+    const char* copyName;
+    struct stage* consumer; // Side consumer started for -c, else NULL
+    pthread_t tid;
+    long long received;     // From upstream
+    long long sent;         // To downstream
+    long long copied;       // To copy
+    struct timespec first;  // First data
+    struct timespec last;   // End of file
+};
 
-    if (argc != 3) {
-        perror("Not enough arguments are provided.");
-        exit(1);
+// Splits command on spaces into a NULL-terminated argument vector
+static char** parseCommand(const char* command, int* argc) {
+    char* copy = strdup(command);
+    char** args = malloc(sizeof(char*));
+    if (copy == NULL || args == NULL) {
+        perror("malloc");
+        exit(-1);
     }
+    int len = 0;
 
-    int pipefd[2]; 
-    char argument1[LEN];
-    char argument2[LEN];
+    char* token = strtok(copy, " \t");
+    while (token != NULL) {
+        args = realloc(args, (len + 2) * sizeof(char*));
+        if (args == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+        args[len] = token;
+        token = strtok(NULL, " \t");
+        ++len;
+    }
+    args[len] = NULL;
 
-    strcpy(argument1, argv[1]);
-    strcpy(argument2, argv[2]);
+    *argc = len;
+    return args;
+}
 
-    char arg1[3][LEN];
-    char arg2[3][LEN];
-    int len1 = 0, len2 = 0;
+// Prints how a stage ended to stderr, keeping stdout to the pipeline
+static void reportStage(int index, const struct stage* s) {
+    if (s->pid <= 0) {
+        fprintf(stderr, "stage %d (%s): not started\n", index + 1, s->args[0]);
+    }
+    else if (WIFEXITED(s->status)) {
+        fprintf(stderr, "stage %d (%s): exit %d\n", index + 1, s->args[0], WEXITSTATUS(s->status));
+    }
+    else if (WIFSIGNALED(s->status)) {
+        fprintf(stderr, "stage %d (%s): killed by signal %d (%s)\n", index + 1, s->args[0],
+                WTERMSIG(s->status), strsignal(WTERMSIG(s->status)));
+    }
+}
 
-    // Tokenize argument1
-    char* token = strtok(argument1, " ");
-    while (token != NULL) {
-        strcpy(arg1[len1], token);
-        token = strtok(NULL, " ");
-        ++len1;
+static double elapsed(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Drops count bytes the copy could not take, so out stays in step with in
+static void discard(int fd, size_t count) {
+    char buf[4096];
+    while (count > 0) {
+        ssize_t n = read(fd, buf, count < sizeof(buf) ? count : sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        count -= n;
     }
+}
 
-    // Tokenize argument2
-    token = strtok(argument2, " ");
-    while (token != NULL) {
-        strcpy(arg2[len2], token);
-        token = strtok(NULL, " ");
-        ++len2;
+// Closes a side the relay cannot write to anymore; EPIPE means its reader exited
+static void dropSide(struct relay* r, int* fd, const char* what) {
+    if (errno != EPIPE) {
+        fprintf(stderr, "edge %d: %s: %s\n", r->edge, what, strerror(errno));
     }
+    close(*fd);
+    *fd = -1;
+}
 
-    char* arr1[len1 + 1];
-    char* arr2[len2 + 1];
+// Relay thread: tee() duplicates what the pipe holds to out without consuming
+// it, then splice() moves the same bytes to the copy. Without a copy, or once
+// one side left, splice() alone moves the data to the other
+static void* relayThread(void* arg) {
+    struct relay* r = arg;
 
-    for (int i = 0; i < len1; ++i) {
-        arr1[i] = arg1[i];
+    // A reader that left gives EPIPE here instead of stopping the whole program
+    sigset_t pipeSignal;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, NULL);
+
+    while (r->out != -1 || r->copy != -1) {
+        ssize_t n;
+        if (r->out != -1 && r->copy != -1) {
+            n = tee(r->in, r->out, RELAY_CHUNK, 0);
+        }
+        else {
+            n = splice(r->in, NULL, r->out != -1 ? r->out : r->copy, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (r->out != -1) {
+                dropSide(r, &r->out, "next stage");
+            }
+            else {
+                dropSide(r, &r->copy, r->copyName);
+            }
+            continue;
+        }
+        if (r->received == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &r->first);
+        }
+        r->received += n;
+
+        if (r->out == -1) {
+            r->copied += n;
+        }
+        else if (r->copy == -1) {
+            r->sent += n;
+        }
+        else {
+            // tee() left the n bytes in the pipe, splice() hands them to the copy
+            r->sent += n;
+            size_t left = n;
+            while (left > 0) {
+                ssize_t m = splice(r->in, NULL, r->copy, NULL, left, SPLICE_F_MOVE);
+                if (m == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (m <= 0) {
+                    dropSide(r, &r->copy, r->copyName);
+                    discard(r->in, left);
+                    break;
+                }
+                r->copied += m;
+                left -= m;
+            }
+        }
     }
-    arr1[len1] = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &r->last);
 
-    for (int i = 0; i < len2; ++i) {
-        arr2[i] = arg2[i];
+    // Closing in passes it on to the upstream stage when both readers left
+    close(r->in);
+    if (r->out != -1) {
+        close(r->out);
+    }
+    if (r->copy != -1) {
+        close(r->copy);
     }
-    arr2[len2] = NULL;
+    return NULL;
+}
 
-    // Create the pipe
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(-1);
+// Prints bytes and throughput of a relayed edge to stderr
+static void reportRelay(const struct relay* r, const struct stage* stages) {
+    double seconds = r->received > 0 ? elapsed(&r->first, &r->last) : 0;
+    fprintf(stderr, "edge %d (%s -> %s): %lld bytes", r->edge, stages[r->edge - 1].args[0],
+            stages[r->edge].args[0], r->received);
+    if (seconds > 0) {
+        fprintf(stderr, " in %.3f s, %.1f MB/s", seconds, r->received / seconds / 1e6);
+    }
+    if (r->sent != r->received) {
+        fprintf(stderr, ", %lld passed on", r->sent);
     }
+    if (r->copyName != NULL) {
+        fprintf(stderr, ", %lld copied to %s", r->copied, r->copyName);
+    }
+    fprintf(stderr, "\n");
+}
 
-    pid_t pid1 = fork();
+// Parses "edge:value" of -t and -c
+static int parseEdge(char* option, int count, char** value) {
+    char* end;
+    long edge = strtol(option, &end, 10);
+    if (end == option || *end != ':' || edge < 1 || edge >= count) {
+        return -1;
+    }
+    *value = end + 1;
+    return edge;
+}
 
-    // Child 1, write end of pipe
-    if (pid1 == 0) {
+// Forks a stage reading input and writing output. All other descriptors are
+// close-on-exec, so the stage holds no pipe but its own two
+static pid_t startStage(struct stage* s, int input, int output) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Redirect stdin to the previous pipe's read end, stdout to the next write end
+        if (input != STDIN_FILENO) {
+            dup2(input, STDIN_FILENO);
+        }
+        if (output != STDOUT_FILENO) {
+            dup2(output, STDOUT_FILENO);
+        }
 
-        // Close read end of pipe
-        close(pipefd[0]);
-        // Redirect stdout to pipe write end
-        dup2(pipefd[1], STDOUT_FILENO);
+        execvp(s->args[0], s->args);
 
-        // Close write end of pipe
-        close(pipefd[1]);
+        // If execvp fails; 127 like a shell's "command not found"
+        perror("execvp failed");
+        exit(127);
+    }
+    if (pid == -1) {
+        perror("fork");
+    }
+    else {
+        s->pid = pid;
+    }
+    return pid;
+}
 
-        // Using execlp to execute command1 with individual arguments
-        if (len1 == 1) {
-            execlp(arr1[0], arr1[0], (char*)NULL);
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-m] [-t edge:file] [-c edge:command] \"<command1> [args]\" [\"<command2> [args]\" ...]\n"
+            "  -m               relay and count every edge\n"
+            "  -t edge:file     copy edge (1: between command 1 and 2) to file\n"
+            "  -c edge:command  copy edge to a second consumer\n", program);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+
+    // Options stop at the first command
+    int monitor = 0;
+    char copyKind[argc];    // 't' or 'c'
+    char* copies[argc];
+    int copyCount = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "+mt:c:")) != -1) {
+        if (opt == 'm') {
+            monitor = 1;
+        }
+        else if (opt == 't' || opt == 'c') {
+            copyKind[copyCount] = opt;
+            copies[copyCount++] = optarg;
         }
-        else if (len1 == 2) { // ls -l
-            execlp(arr1[0], arr1[0], arr1[1], (char*)NULL);
+        else {
+            usage(argv[0]);
         }
-        else if (len1 == 3) { // ls -l -a
-            execlp(arr1[0], arr1[0], arr1[1], arr1[2], (char*)NULL);
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+
+    int count = argc - optind;
+    // The pipeline's stages, then one side consumer per -c
+    struct stage* stages = calloc(count + copyCount, sizeof(struct stage));
+    struct relay* relays = calloc(count, sizeof(struct relay));
+    if (stages == NULL || relays == NULL) {
+        perror("calloc");
+        exit(-1);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        stages[i].args = parseCommand(argv[optind + i], &stages[i].argc);
+        if (stages[i].argc == 0) {
+            fprintf(stderr, "Command %d is empty.\n", i + 1);
+            exit(1);
         }
+    }
+    for (int i = 1; i < count; ++i) {
+        relays[i].edge = monitor ? i : 0;
+        relays[i].copy = -1;
+    }
 
-        // If execlp fails
-        perror("execlp failed");  
-        exit(1);
+    // Every copy turns on the relay of its edge
+    int sides = 0;
+    for (int i = 0; i < copyCount; ++i) {
+        char* value;
+        int edge = parseEdge(copies[i], count, &value);
+        if (edge == -1 || relays[edge].copyName != NULL) {
+            fprintf(stderr, "-%c %s: need an edge from 1 to %d, with one copy each\n", copyKind[i], copies[i], count - 1);
+            exit(1);
+        }
+        relays[edge].edge = edge;
+        relays[edge].copyName = value;
+        if (copyKind[i] == 't') {
+            relays[edge].copy = open(value, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (relays[edge].copy == -1) {
+                perror(value);
+                exit(1);
+            }
+        }
+        else {
+            struct stage* side = &stages[count + sides++];
+            side->args = parseCommand(value, &side->argc);
+            side->copyOf = edge;
+            relays[edge].consumer = side;
+            if (side->argc == 0) {
+                fprintf(stderr, "-c %d: command is empty.\n", edge);
+                exit(1);
+            }
+        }
     }
 
-    // Child 2, Read end of pipe
-    pid_t pid2 = fork();
-    if (pid2 == 0) {
-        // Close write end of pipe
-        close(pipefd[1]);
-        // Redirect stdin to pipe read end
-        dup2(pipefd[0], STDIN_FILENO);
+    // Read end of the pipe from the previous stage; the first stage reads our stdin
+    int input = STDIN_FILENO;
+    int started = 0;
 
-        // Close read end of pipe
-        close(pipefd[0]);
+    for (int i = 0; i < count; ++i) {
+        // Every stage but the last writes into a new pipe, the last one to our stdout.
+        // All pipes are close-on-exec; dup2() clears that for the stage's own ends
+        int pipefd[2] = { -1, STDOUT_FILENO };
+        int next = -1;
+        struct relay* r = i < count - 1 && relays[i + 1].edge != 0 ? &relays[i + 1] : NULL;
+        if (i < count - 1) {
+            if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                break;
+            }
+            next = pipefd[0];
+        }
+        if (r != NULL) {
+            // The relay reads the stage's pipe and writes a second one to the next stage
+            int relayfd[2];
+            if (pipe2(relayfd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                break;
+            }
+            r->in = pipefd[0];
+            r->out = relayfd[1];
+            next = relayfd[0];
+
+            if (r->consumer != NULL) {
+                // Side consumer of this edge, writing to our stdout
+                int sidefd[2];
+                if (pipe2(sidefd, O_CLOEXEC) == -1) {
+                    perror("pipe");
+                }
+                else {
+                    if (startStage(r->consumer, sidefd[0], STDOUT_FILENO) > 0) {
+                        ++started;
+                        r->copy = sidefd[1];
+                    }
+                    else {
+                        close(sidefd[1]);
+                    }
+                    close(sidefd[0]);
+                }
+            }
+        }
+
+        pid_t pid = startStage(&stages[i], input, pipefd[1]);
+        if (pid == -1) {
+            if (i < count - 1) {
+                close(pipefd[1]);
+                close(next);
+            }
+            if (r != NULL) {
+                close(r->in);
+                close(r->out);
+                r->edge = 0;
+            }
+            break;
+        }
+        ++started;
+
+        if (r != NULL && pthread_create(&r->tid, NULL, relayThread, r) != 0) {
+            perror("pthread_create");
+            exit(-1);
+        }
 
-        // Using execlp to execute command2 with individual arguments
-        if (len2 == 1) {
-            execlp(arr2[0], arr2[0], (char*)NULL);
+        // The parent keeps only the read end the next stage needs, so every
+        // pipe sees end of file once its writer exits
+        if (input != STDIN_FILENO) {
+            close(input);
         }
-        else if (len2 == 2) { 
-            execlp(arr2[0], arr2[0], arr2[1], (char*)NULL);
+        if (pipefd[1] != STDOUT_FILENO) {
+            close(pipefd[1]);
         }
-        else if (len2 == 3) { 
-            execlp(arr2[0], arr2[0], arr2[1], arr2[2], (char*)NULL);
+        input = next;
+    }
+    if (input != STDIN_FILENO && input != -1) {
+        close(input);
+    }
+    // Copies whose edge was never reached
+    for (int i = 1; i < count; ++i) {
+        if (relays[i].edge != 0 && relays[i].tid == 0) {
+            if (relays[i].copy != -1) {
+                close(relays[i].copy);
+            }
+            relays[i].edge = 0;
         }
+    }
 
-        // If execlp fails
-        perror("execlp");
-        exit(1);
+    // Wait for every stage, in whatever order they finish
+    for (int waiting = started; waiting > 0; ) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            break;
+        }
+        for (int i = 0; i < count + copyCount; ++i) {
+            if (stages[i].pid == pid) {
+                stages[i].status = status;
+                --waiting;
+                break;
+            }
+        }
     }
 
-    // Parent process closes both pipe ends
-    close(pipefd[0]);
-    close(pipefd[1]);
+    for (int i = 1; i < count; ++i) {
+        if (relays[i].edge != 0) {
+            pthread_join(relays[i].tid, NULL);
+            reportRelay(&relays[i], stages);
+        }
+    }
 
-    // Wait for both child processes
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+    // Like a shell with pipefail: the status of the last stage that failed.
+    // SIGPIPE is not a failure, it only means a later stage stopped reading
+    int result = started < count + sides ? 1 : 0;
+    for (int i = 0; i < count + sides; ++i) {
+        reportStage(i, &stages[i]);
+        if (stages[i].pid > 0) {
+            if (WIFEXITED(stages[i].status) && WEXITSTATUS(stages[i].status) != 0) {
+                result = WEXITSTATUS(stages[i].status);
+            }
+            else if (WIFSIGNALED(stages[i].status) && WTERMSIG(stages[i].status) != SIGPIPE) {
+                result = 128 + WTERMSIG(stages[i].status);
+            }
+        }
+    }
 
-    return 0;
+    return result;
 }
 
 